@@ -0,0 +1,631 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config-cache.h"
+#include "criteria.h"
+#include "text.h"
+
+// Bump whenever the serialized structures below change.
+#define MAKO_CONFIG_CACHE_VERSION 3
+
+static const char cache_magic[8] = "MAKOCFG";
+
+// The cache is written in the native layout, it isn't meant to be shared
+// between machines. The sizes catch builds which were changed without bumping
+// the version.
+struct config_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t style_spec_size;
+	uint32_t criteria_spec_size;
+	uint32_t path_len; // Source path, right after the header
+	struct mako_config_source source;
+	uint64_t data_size; // Serialized config, after the path
+	uint64_t data_hash; // Of the path and the serialized config
+};
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+	// FNV-1a
+	const unsigned char *bytes = data;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+#define HASH_INIT 0xcbf29ce484222325
+
+// Maps the whole file read-only. An empty file isn't mapped, and yields NULL
+// with a zero size.
+static bool map_file(int fd, void **data, size_t *size) {
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		return false;
+	}
+	*size = st.st_size;
+	*data = NULL;
+	if (*size == 0) {
+		return true;
+	}
+	*data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (*data == MAP_FAILED) {
+		*data = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool read_config_source(const char *path, struct mako_config_source *out) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	void *data;
+	size_t size;
+	if (fstat(fd, &st) != 0 || !map_file(fd, &data, &size)) {
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	out->mtime_sec = st.st_mtim.tv_sec;
+	out->mtime_nsec = st.st_mtim.tv_nsec;
+	out->size = size;
+	out->hash = hash_bytes(HASH_INIT, data, size);
+	if (data != NULL) {
+		munmap(data, size);
+	}
+	return true;
+}
+
+// $XDG_CACHE_HOME/mako/config.cache, the directory being returned in `dir`.
+static char *get_cache_path(char **dir) {
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *suffix = "";
+	if (cache_home == NULL || cache_home[0] == '\0') {
+		cache_home = getenv("HOME");
+		if (cache_home == NULL) {
+			return NULL;
+		}
+		suffix = "/.cache";
+	}
+
+	size_t len = strlen(cache_home) + strlen(suffix) + strlen("/mako") + 1;
+	*dir = malloc(len);
+	char *path = malloc(len + strlen("/config.cache"));
+	if (*dir == NULL || path == NULL) {
+		free(*dir);
+		free(path);
+		return NULL;
+	}
+	snprintf(*dir, len, "%s%s/mako", cache_home, suffix);
+	snprintf(path, len + strlen("/config.cache"), "%s/config.cache", *dir);
+	return path;
+}
+
+static bool write_bytes(struct mako_text_buffer *buf, const void *data,
+		size_t len) {
+	return text_buffer_append(buf, data, len);
+}
+
+static bool write_u32(struct mako_text_buffer *buf, uint32_t value) {
+	return write_bytes(buf, &value, sizeof(value));
+}
+
+static bool write_i32(struct mako_text_buffer *buf, int32_t value) {
+	return write_bytes(buf, &value, sizeof(value));
+}
+
+static bool write_u64(struct mako_text_buffer *buf, uint64_t value) {
+	return write_bytes(buf, &value, sizeof(value));
+}
+
+static bool write_bool(struct mako_text_buffer *buf, bool value) {
+	uint8_t byte = value;
+	return write_bytes(buf, &byte, sizeof(byte));
+}
+
+static bool write_string(struct mako_text_buffer *buf, const char *s) {
+	if (s == NULL) {
+		return write_u32(buf, UINT32_MAX);
+	}
+	size_t len = strlen(s);
+	return write_u32(buf, len) && write_bytes(buf, s, len);
+}
+
+static bool write_format_program(struct mako_text_buffer *buf,
+		const struct mako_format_program *program) {
+	if (!write_string(buf, program->literals) ||
+			!write_u64(buf, program->op_count)) {
+		return false;
+	}
+	for (size_t i = 0; i < program->op_count; ++i) {
+		const struct mako_format_op *op = &program->ops[i];
+		if (!write_u32(buf, op->type) ||
+				!write_u32(buf, (unsigned char)op->specifier) ||
+				!write_u64(buf, op->offset) || !write_u64(buf, op->len)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool write_style(struct mako_text_buffer *buf,
+		const struct mako_style *style) {
+	return write_bytes(buf, &style->spec, sizeof(style->spec)) &&
+		write_i32(buf, style->width) &&
+		write_i32(buf, style->height) &&
+		write_i32(buf, style->margin.top) &&
+		write_i32(buf, style->margin.right) &&
+		write_i32(buf, style->margin.bottom) &&
+		write_i32(buf, style->margin.left) &&
+		write_i32(buf, style->padding) &&
+		write_i32(buf, style->border_size) &&
+		write_string(buf, style->font) &&
+		write_bool(buf, style->markup) &&
+		write_string(buf, style->format) &&
+		write_format_program(buf, &style->format_program) &&
+		write_bool(buf, style->actions) &&
+		write_i32(buf, style->default_timeout) &&
+		write_bool(buf, style->ignore_timeout) &&
+		write_i32(buf, style->max_body_length) &&
+		write_i32(buf, style->max_lines) &&
+		write_string(buf, style->group) &&
+		write_u32(buf, style->colors.background) &&
+		write_u32(buf, style->colors.text) &&
+		write_u32(buf, style->colors.border);
+}
+
+static bool write_criteria(struct mako_text_buffer *buf,
+		const struct mako_criteria *criteria) {
+	return write_bytes(buf, &criteria->spec, sizeof(criteria->spec)) &&
+		write_style(buf, &criteria->style) &&
+		write_string(buf, criteria->app_name) &&
+		write_string(buf, criteria->app_icon) &&
+		write_bool(buf, criteria->actionable) &&
+		write_bool(buf, criteria->expiring) &&
+		write_bool(buf, criteria->grouped) &&
+		write_i32(buf, criteria->urgency) &&
+		write_string(buf, criteria->category) &&
+		write_string(buf, criteria->desktop_entry) &&
+		write_string(buf, criteria->summary_contains) &&
+		write_string(buf, criteria->body_contains);
+}
+
+// Everything load_config_file sets. The keyword matcher and the superstyle
+// depend on the command line arguments too, so they're built after loading.
+static bool write_config(struct mako_text_buffer *buf,
+		struct mako_config *config) {
+	if (!write_u32(buf, wl_list_length(&config->criteria))) {
+		return false;
+	}
+	struct mako_criteria *criteria;
+	wl_list_for_each(criteria, &config->criteria, link) {
+		if (!write_criteria(buf, criteria)) {
+			return false;
+		}
+	}
+
+	return write_style(buf, &config->hidden_style) &&
+		write_i32(buf, config->max_visible) &&
+		write_i32(buf, config->max_notifications) &&
+		write_i32(buf, config->max_notifications_bytes) &&
+		write_bool(buf, config->deduplicate) &&
+		write_u32(buf, config->group_by) &&
+		write_bool(buf, config->batch_closed_signal) &&
+		write_string(buf, config->output) &&
+		write_u32(buf, config->anchor) &&
+		write_u32(buf, config->sort_criteria) &&
+		write_u32(buf, config->sort_asc) &&
+		write_i32(buf, config->rate_limit) &&
+		write_i32(buf, config->rate_limit_burst) &&
+		write_u32(buf, config->rate_limit_action) &&
+		write_bool(buf, config->preload_fonts) &&
+		write_u32(buf, config->button_bindings.left) &&
+		write_u32(buf, config->button_bindings.right) &&
+		write_u32(buf, config->button_bindings.middle);
+}
+
+struct cache_reader {
+	const char *data;
+	size_t len, pos;
+};
+
+static bool read_bytes(struct cache_reader *r, void *out, size_t len) {
+	if (len > r->len - r->pos) {
+		return false;
+	}
+	memcpy(out, r->data + r->pos, len);
+	r->pos += len;
+	return true;
+}
+
+static bool read_u32(struct cache_reader *r, uint32_t *out) {
+	return read_bytes(r, out, sizeof(*out));
+}
+
+static bool read_i32(struct cache_reader *r, int32_t *out) {
+	return read_bytes(r, out, sizeof(*out));
+}
+
+static bool read_int(struct cache_reader *r, int *out) {
+	int32_t value;
+	if (!read_i32(r, &value)) {
+		return false;
+	}
+	*out = value;
+	return true;
+}
+
+static bool read_u64(struct cache_reader *r, uint64_t *out) {
+	return read_bytes(r, out, sizeof(*out));
+}
+
+static bool read_bool(struct cache_reader *r, bool *out) {
+	uint8_t byte;
+	if (!read_bytes(r, &byte, sizeof(byte)) || byte > 1) {
+		return false;
+	}
+	*out = byte;
+	return true;
+}
+
+// Replaces *out, which must be NULL or allocated.
+static bool read_string(struct cache_reader *r, char **out) {
+	uint32_t len;
+	if (!read_u32(r, &len)) {
+		return false;
+	}
+	free(*out);
+	*out = NULL;
+	if (len == UINT32_MAX) {
+		return true;
+	}
+	if (len > r->len - r->pos) {
+		return false;
+	}
+	*out = strndup(r->data + r->pos, len);
+	if (*out == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+	r->pos += len;
+	return true;
+}
+
+static bool read_format_program(struct cache_reader *r,
+		struct mako_format_program *program) {
+	uint64_t op_count;
+	if (!read_string(r, &program->literals) || !read_u64(r, &op_count)) {
+		return false;
+	}
+	if (program->literals == NULL) {
+		return op_count == 0;
+	}
+
+	// Each op takes up more than a byte in the cache
+	if (op_count > r->len - r->pos) {
+		return false;
+	}
+	program->ops = calloc(op_count + 1, sizeof(struct mako_format_op));
+	if (program->ops == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+
+	size_t literals_len = strlen(program->literals);
+	for (size_t i = 0; i < op_count; ++i) {
+		uint32_t type, specifier;
+		uint64_t offset, len;
+		if (!read_u32(r, &type) || !read_u32(r, &specifier) ||
+				!read_u64(r, &offset) || !read_u64(r, &len)) {
+			return false;
+		}
+		if (type == MAKO_FORMAT_OP_LITERAL) {
+			if (offset > literals_len || len > literals_len - offset) {
+				return false;
+			}
+		} else if (type != MAKO_FORMAT_OP_SPECIFIER) {
+			return false;
+		}
+		program->ops[i] = (struct mako_format_op){
+			.type = type,
+			.specifier = specifier,
+			.offset = offset,
+			.len = len,
+		};
+		program->op_count = i + 1;
+	}
+	return true;
+}
+
+// `style` must be initialized, it's left for finish_style to clean up even if
+// reading fails.
+static bool read_style(struct cache_reader *r, struct mako_style *style) {
+	return read_bytes(r, &style->spec, sizeof(style->spec)) &&
+		read_i32(r, &style->width) &&
+		read_i32(r, &style->height) &&
+		read_i32(r, &style->margin.top) &&
+		read_i32(r, &style->margin.right) &&
+		read_i32(r, &style->margin.bottom) &&
+		read_i32(r, &style->margin.left) &&
+		read_i32(r, &style->padding) &&
+		read_i32(r, &style->border_size) &&
+		read_string(r, &style->font) &&
+		read_bool(r, &style->markup) &&
+		read_string(r, &style->format) &&
+		read_format_program(r, &style->format_program) &&
+		read_bool(r, &style->actions) &&
+		read_int(r, &style->default_timeout) &&
+		read_bool(r, &style->ignore_timeout) &&
+		read_int(r, &style->max_body_length) &&
+		read_int(r, &style->max_lines) &&
+		read_string(r, &style->group) &&
+		read_u32(r, &style->colors.background) &&
+		read_u32(r, &style->colors.text) &&
+		read_u32(r, &style->colors.border);
+}
+
+static bool read_criteria(struct cache_reader *r,
+		struct mako_criteria *criteria) {
+	int32_t urgency;
+	if (!read_bytes(r, &criteria->spec, sizeof(criteria->spec)) ||
+			!read_style(r, &criteria->style) ||
+			!read_string(r, &criteria->app_name) ||
+			!read_string(r, &criteria->app_icon) ||
+			!read_bool(r, &criteria->actionable) ||
+			!read_bool(r, &criteria->expiring) ||
+			!read_bool(r, &criteria->grouped) ||
+			!read_i32(r, &urgency) ||
+			!read_string(r, &criteria->category) ||
+			!read_string(r, &criteria->desktop_entry) ||
+			!read_string(r, &criteria->summary_contains) ||
+			!read_string(r, &criteria->body_contains)) {
+		return false;
+	}
+	criteria->urgency = urgency;
+	return true;
+}
+
+static bool read_enum(struct cache_reader *r, uint32_t max, uint32_t *out) {
+	return read_u32(r, out) && *out <= max;
+}
+
+static bool read_config(struct cache_reader *r, struct mako_config *config) {
+	uint32_t criteria_count;
+	if (!read_u32(r, &criteria_count) || criteria_count == 0) {
+		return false;
+	}
+	for (uint32_t i = 0; i < criteria_count; ++i) {
+		struct mako_criteria *criteria = create_criteria(config);
+		if (criteria == NULL || !read_criteria(r, criteria)) {
+			return false;
+		}
+	}
+
+	uint32_t group_by, rate_limit_action, left, right, middle;
+	if (!read_style(r, &config->hidden_style) ||
+			!read_i32(r, &config->max_visible) ||
+			!read_int(r, &config->max_notifications) ||
+			!read_int(r, &config->max_notifications_bytes) ||
+			!read_bool(r, &config->deduplicate) ||
+			!read_enum(r, MAKO_GROUP_BY_APP_NAME, &group_by) ||
+			!read_bool(r, &config->batch_closed_signal) ||
+			!read_string(r, &config->output) ||
+			!read_u32(r, &config->anchor) ||
+			!read_u32(r, &config->sort_criteria) ||
+			!read_u32(r, &config->sort_asc) ||
+			!read_int(r, &config->rate_limit) ||
+			!read_int(r, &config->rate_limit_burst) ||
+			!read_enum(r, MAKO_RATE_LIMIT_ACTION_MERGE, &rate_limit_action) ||
+			!read_bool(r, &config->preload_fonts) ||
+			!read_enum(r, MAKO_BUTTON_BINDING_INVOKE_DEFAULT_ACTION, &left) ||
+			!read_enum(r, MAKO_BUTTON_BINDING_INVOKE_DEFAULT_ACTION, &right) ||
+			!read_enum(r, MAKO_BUTTON_BINDING_INVOKE_DEFAULT_ACTION,
+				&middle)) {
+		return false;
+	}
+	config->group_by = group_by;
+	config->rate_limit_action = rate_limit_action;
+	config->button_bindings.left = left;
+	config->button_bindings.right = right;
+	config->button_bindings.middle = middle;
+
+	// The output can't be NULL, whatever the cache says
+	return config->output != NULL && r->pos == r->len;
+}
+
+static bool check_header(const struct config_cache_header *header,
+		size_t size, const char *path,
+		const struct mako_config_source *source) {
+	return memcmp(header->magic, cache_magic, sizeof(cache_magic)) == 0 &&
+		header->version == MAKO_CONFIG_CACHE_VERSION &&
+		header->style_spec_size == sizeof(struct mako_style_spec) &&
+		header->criteria_spec_size == sizeof(struct mako_criteria_spec) &&
+		header->source.mtime_sec == source->mtime_sec &&
+		header->source.mtime_nsec == source->mtime_nsec &&
+		header->source.size == source->size &&
+		header->source.hash == source->hash &&
+		header->path_len == strlen(path) &&
+		size - sizeof(*header) >= header->path_len &&
+		size - sizeof(*header) - header->path_len == header->data_size;
+}
+
+// Replaces the contents of `config`, which has just been initialized with the
+// defaults, with the cached result of parsing the config file at `path`.
+// Returns false if there's no up-to-date cache for it, leaving `config` as it
+// was.
+bool load_config_cache(struct mako_config *config, const char *path,
+		const struct mako_config_source *source) {
+	char *cache_dir = NULL;
+	char *cache_path = get_cache_path(&cache_dir);
+	free(cache_dir);
+	if (cache_path == NULL) {
+		return false;
+	}
+	int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+	free(cache_path);
+	if (fd < 0) {
+		return false;
+	}
+
+	void *data;
+	size_t size;
+	bool mapped = map_file(fd, &data, &size);
+	close(fd);
+	if (!mapped || data == NULL) {
+		return false;
+	}
+
+	bool ok = false;
+	struct mako_config cached = {0};
+	wl_list_init(&cached.criteria);
+	init_keyword_matcher(&cached.keywords);
+	init_empty_style(&cached.superstyle);
+	init_empty_style(&cached.hidden_style);
+
+	struct config_cache_header header;
+	if (size < sizeof(header)) {
+		goto out;
+	}
+	memcpy(&header, data, sizeof(header));
+	if (!check_header(&header, size, path, source)) {
+		goto out;
+	}
+
+	const char *contents = (const char *)data + sizeof(header);
+	if (memcmp(contents, path, header.path_len) != 0 ||
+			hash_bytes(HASH_INIT, contents, size - sizeof(header)) !=
+				header.data_hash) {
+		goto out;
+	}
+
+	struct cache_reader reader = {
+		.data = contents + header.path_len,
+		.len = header.data_size,
+	};
+	ok = read_config(&reader, &cached);
+
+out:
+	munmap(data, size);
+	if (!ok) {
+		finish_config(&cached);
+		return false;
+	}
+	swap_config(config, &cached);
+	return true;
+}
+
+// Creates the cache directory, and the cache home it's in if needed.
+static bool make_cache_dir(char *dir) {
+	char *slash = strrchr(dir, '/');
+	if (slash != NULL && slash != dir) {
+		*slash = '\0';
+		int ret = mkdir(dir, 0700);
+		*slash = '/';
+		if (ret != 0 && errno != EEXIST) {
+			return false;
+		}
+	}
+	return mkdir(dir, 0700) == 0 || errno == EEXIST;
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+// Writes the config just parsed from `path` to the cache. The source stamp
+// must have been read before parsing, so that the cache doesn't claim to match
+// changes made in the meantime. Failing to save the cache isn't an error.
+void save_config_cache(struct mako_config *config, const char *path,
+		const struct mako_config_source *source) {
+	char *cache_dir = NULL;
+	char *cache_path = get_cache_path(&cache_dir);
+	if (cache_path == NULL) {
+		return;
+	}
+
+	struct mako_text_buffer buf;
+	init_text_buffer(&buf);
+
+	struct config_cache_header header = {
+		.version = MAKO_CONFIG_CACHE_VERSION,
+		.style_spec_size = sizeof(struct mako_style_spec),
+		.criteria_spec_size = sizeof(struct mako_criteria_spec),
+		.path_len = strlen(path),
+		.source = *source,
+	};
+	memcpy(header.magic, cache_magic, sizeof(cache_magic));
+
+	// Leave room for the header, which needs the size and hash of the rest
+	char *tmp_path = NULL;
+	int fd = -1;
+	if (!write_bytes(&buf, &header, sizeof(header)) ||
+			!write_bytes(&buf, path, header.path_len) ||
+			!write_config(&buf, config)) {
+		goto out;
+	}
+	header.data_size = buf.len - sizeof(header) - header.path_len;
+	header.data_hash = hash_bytes(HASH_INIT, buf.data + sizeof(header),
+		buf.len - sizeof(header));
+	memcpy(buf.data, &header, sizeof(header));
+
+	if (!make_cache_dir(cache_dir)) {
+		goto error;
+	}
+
+	// Write to a temporary file first, so that other instances never map a
+	// half-written cache
+	tmp_path = malloc(strlen(cache_path) + strlen(".XXXXXX") + 1);
+	if (tmp_path == NULL) {
+		goto out;
+	}
+	sprintf(tmp_path, "%s.XXXXXX", cache_path);
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		goto error;
+	}
+	bool written = write_all(fd, buf.data, buf.len);
+	if (close(fd) != 0) {
+		written = false;
+	}
+	fd = -1;
+	if (!written || rename(tmp_path, cache_path) != 0) {
+		unlink(tmp_path);
+		goto error;
+	}
+	goto out;
+
+error:
+	fprintf(stderr, "Failed to write config cache %s: %s\n", cache_path,
+		strerror(errno));
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(tmp_path);
+	finish_text_buffer(&buf);
+	free(cache_path);
+	free(cache_dir);
+}
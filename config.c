@@ -10,7 +10,9 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "config-cache.h"
 #include "criteria.h"
+#include "timings.h"
 #include "types.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 
@@ -22,6 +24,7 @@ static int32_t max(int32_t a, int32_t b) {
 
 void init_default_config(struct mako_config *config) {
 	wl_list_init(&config->criteria);
+	init_keyword_matcher(&config->keywords);
 	struct mako_criteria *root_criteria = create_criteria(config);
 	init_default_style(&root_criteria->style);
 
@@ -29,18 +32,33 @@ void init_default_config(struct mako_config *config) {
 
 	init_empty_style(&config->hidden_style);
 	config->hidden_style.format = strdup("(%h more)");
+	compile_format(config->hidden_style.format,
+		&config->hidden_style.format_program);
 	config->hidden_style.spec.format = true;
 
 	config->output = strdup("");
 	config->max_visible = 5;
+	config->max_notifications = 0;
+	config->max_notifications_bytes = 0;
+	config->deduplicate = false;
+	config->group_by = MAKO_GROUP_BY_NONE;
+	config->batch_closed_signal = false;
 
 	config->sort_criteria = MAKO_SORT_CRITERIA_TIME;
 	config->sort_asc = 0;
 
+	config->rate_limit = 0;
+	config->rate_limit_burst = 10;
+	config->rate_limit_action = MAKO_RATE_LIMIT_ACTION_MERGE;
+
+	config->preload_fonts = true;
+
 	config->button_bindings.left = MAKO_BUTTON_BINDING_INVOKE_DEFAULT_ACTION;
 	config->button_bindings.right = MAKO_BUTTON_BINDING_DISMISS;
 	config->button_bindings.middle = MAKO_BUTTON_BINDING_NONE;
 
+	config->timings = false;
+
 	config->anchor =
 		ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
 }
@@ -50,6 +68,7 @@ void finish_config(struct mako_config *config) {
 	wl_list_for_each_safe(criteria, tmp, &config->criteria, link) {
 		destroy_criteria(criteria);
 	}
+	finish_keyword_matcher(&config->keywords);
 
 	finish_style(&config->superstyle);
 	finish_style(&config->hidden_style);
@@ -71,11 +90,17 @@ void init_default_style(struct mako_style *style) {
 	style->font = strdup("monospace 10");
 	style->markup = true;
 	style->format = strdup("<b>%s</b>\n%b");
+	compile_format(style->format, &style->format_program);
 
 	style->actions = true;
 	style->default_timeout = 0;
 	style->ignore_timeout = false;
 
+	style->max_body_length = 0;
+	style->max_lines = 0;
+
+	style->group = strdup("");
+
 	style->colors.background = 0x285577FF;
 	style->colors.text = 0xFFFFFFFF;
 	style->colors.border = 0x4C7899FF;
@@ -90,7 +115,9 @@ void init_empty_style(struct mako_style *style) {
 
 void finish_style(struct mako_style *style) {
 	free(style->font);
+	free(style->group);
 	free(style->format);
+	finish_format_program(&style->format_program);
 }
 
 // Update `target` with the values specified in `style`. If a failure occurs,
@@ -100,6 +127,8 @@ bool apply_style(struct mako_style *target, const struct mako_style *style) {
 	// to bail without changing `target`.
 	char *new_font = NULL;
 	char *new_format = NULL;
+	char *new_group = NULL;
+	struct mako_format_program new_format_program = {0};
 
 	if (style->spec.font) {
 		new_font = strdup(style->font);
@@ -111,8 +140,21 @@ bool apply_style(struct mako_style *target, const struct mako_style *style) {
 
 	if (style->spec.format) {
 		new_format = strdup(style->format);
-		if (new_format == NULL) {
+		if (new_format == NULL || !copy_format_program(&new_format_program,
+				&style->format_program)) {
 			free(new_font);
+			free(new_format);
+			fprintf(stderr, "allocation failed\n");
+			return false;
+		}
+	}
+
+	if (style->spec.group) {
+		new_group = strdup(style->group);
+		if (new_group == NULL) {
+			free(new_font);
+			free(new_format);
+			finish_format_program(&new_format_program);
 			fprintf(stderr, "allocation failed\n");
 			return false;
 		}
@@ -159,6 +201,8 @@ bool apply_style(struct mako_style *target, const struct mako_style *style) {
 	if (style->spec.format) {
 		free(target->format);
 		target->format = new_format;
+		finish_format_program(&target->format_program);
+		target->format_program = new_format_program;
 		target->spec.format = true;
 	}
 
@@ -177,6 +221,22 @@ bool apply_style(struct mako_style *target, const struct mako_style *style) {
 		target->spec.ignore_timeout = true;
 	}
 
+	if (style->spec.max_body_length) {
+		target->max_body_length = style->max_body_length;
+		target->spec.max_body_length = true;
+	}
+
+	if (style->spec.max_lines) {
+		target->max_lines = style->max_lines;
+		target->spec.max_lines = true;
+	}
+
+	if (style->spec.group) {
+		free(target->group);
+		target->group = new_group;
+		target->spec.group = true;
+	}
+
 	if (style->spec.colors.background) {
 		target->colors.background = style->colors.background;
 		target->spec.colors.background = true;
@@ -276,6 +336,27 @@ static bool apply_config_option(struct mako_config *config, const char *name,
 		const char *value) {
 	if (strcmp(name, "max-visible") == 0) {
 		return parse_int(value, &config->max_visible);
+	} else if (strcmp(name, "max-notifications") == 0) {
+		return parse_int(value, &config->max_notifications) &&
+			config->max_notifications >= 0;
+	} else if (strcmp(name, "max-notifications-bytes") == 0) {
+		return parse_int(value, &config->max_notifications_bytes) &&
+			config->max_notifications_bytes >= 0;
+	} else if (strcmp(name, "deduplicate") == 0) {
+		return parse_boolean(value, &config->deduplicate);
+	} else if (strcmp(name, "batch-closed-signal") == 0) {
+		return parse_boolean(value, &config->batch_closed_signal);
+	} else if (strcmp(name, "preload-fonts") == 0) {
+		return parse_boolean(value, &config->preload_fonts);
+	} else if (strcmp(name, "group-by") == 0) {
+		if (strcmp(value, "none") == 0) {
+			config->group_by = MAKO_GROUP_BY_NONE;
+		} else if (strcmp(value, "app-name") == 0) {
+			config->group_by = MAKO_GROUP_BY_APP_NAME;
+		} else {
+			return false;
+		}
+		return true;
 	} else if (strcmp(name, "output") == 0) {
 		free(config->output);
 		config->output = strdup(value);
@@ -312,6 +393,20 @@ static bool apply_config_option(struct mako_config *config, const char *name,
 			return false;
 		}
 		return true;
+	} else if (strcmp(name, "rate-limit") == 0) {
+		return parse_int(value, &config->rate_limit) && config->rate_limit >= 0;
+	} else if (strcmp(name, "rate-limit-burst") == 0) {
+		return parse_int(value, &config->rate_limit_burst) &&
+			config->rate_limit_burst >= 1;
+	} else if (strcmp(name, "rate-limit-action") == 0) {
+		if (strcmp(value, "drop") == 0) {
+			config->rate_limit_action = MAKO_RATE_LIMIT_ACTION_DROP;
+		} else if (strcmp(value, "merge") == 0) {
+			config->rate_limit_action = MAKO_RATE_LIMIT_ACTION_MERGE;
+		} else {
+			return false;
+		}
+		return true;
 	}
 
 	return false;
@@ -347,13 +442,25 @@ static bool apply_style_option(struct mako_style *style, const char *name,
 		return spec->actions = parse_boolean(value, &style->actions);
 	} else if (strcmp(name, "format") == 0) {
 		free(style->format);
-		return spec->format = parse_format(value, &style->format);
+		return spec->format = parse_format(value, &style->format) &&
+			compile_format(style->format, &style->format_program);
 	} else if (strcmp(name, "default-timeout") == 0) {
 		return spec->default_timeout =
 			parse_int(value, &style->default_timeout);
 	} else if (strcmp(name, "ignore-timeout") == 0) {
 		return spec->ignore_timeout =
 			parse_boolean(value, &style->ignore_timeout);
+	} else if (strcmp(name, "max-body-length") == 0) {
+		return spec->max_body_length =
+			parse_int(value, &style->max_body_length) &&
+			style->max_body_length >= 0;
+	} else if (strcmp(name, "max-lines") == 0) {
+		return spec->max_lines = parse_int(value, &style->max_lines) &&
+			style->max_lines >= 0;
+	} else if (strcmp(name, "group") == 0) {
+		free(style->group);
+		style->group = strdup(value);
+		return spec->group = style->group != NULL;
 	}
 
 	return false;
@@ -363,7 +470,8 @@ static bool file_exists(const char *path) {
 	return path && access(path, R_OK) != -1;
 }
 
-static char *get_config_path(void) {
+// Returns the path of the config file in use, or NULL if there is none.
+char *get_config_path(void) {
 	static const char *config_paths[] = {
 		"$HOME/.mako/config",
 		"$XDG_CONFIG_HOME/mako/config",
@@ -397,10 +505,22 @@ static char *get_config_path(void) {
 
 int load_config_file(struct mako_config *config) {
 	char *path = get_config_path();
+	mark_timing("config path");
 	if (!path) {
 		return 0;
 	}
 
+	// Parsing is skipped entirely if the file didn't change since it was last
+	// parsed. The stamp is taken before parsing, so that changes made while
+	// parsing make the cache stale rather than wrong.
+	struct mako_config_source source;
+	bool cacheable = read_config_source(path, &source);
+	if (cacheable && load_config_cache(config, path, &source)) {
+		mark_timing("config file (cached)");
+		free(path);
+		return 0;
+	}
+
 	FILE *f = fopen(path, "r");
 	if (!f) {
 		fprintf(stderr, "Unable to open %s for reading", path);
@@ -486,6 +606,11 @@ int load_config_file(struct mako_config *config) {
 	free(section);
 	free(line);
 	fclose(f);
+
+	mark_timing("config file");
+	if (ret == 0 && cacheable) {
+		save_config_cache(config, path, &source);
+	}
 	free(path);
 	return ret;
 }
@@ -493,6 +618,7 @@ int load_config_file(struct mako_config *config) {
 int parse_config_arguments(struct mako_config *config, int argc, char **argv) {
 	static const struct option long_options[] = {
 		{"help", no_argument, 0, 'h'},
+		{"timings", no_argument, 0, 't'},
 		{"font", required_argument, 0, 0},
 		{"background-color", required_argument, 0, 0},
 		{"text-color", required_argument, 0, 0},
@@ -506,11 +632,23 @@ int parse_config_arguments(struct mako_config *config, int argc, char **argv) {
 		{"actions", required_argument, 0, 0},
 		{"format", required_argument, 0, 0},
 		{"max-visible", required_argument, 0, 0},
+		{"max-notifications", required_argument, 0, 0},
+		{"max-notifications-bytes", required_argument, 0, 0},
+		{"deduplicate", required_argument, 0, 0},
+		{"group-by", required_argument, 0, 0},
+		{"batch-closed-signal", required_argument, 0, 0},
+		{"group", required_argument, 0, 0},
 		{"default-timeout", required_argument, 0, 0},
 		{"ignore-timeout", required_argument, 0, 0},
+		{"max-body-length", required_argument, 0, 0},
+		{"max-lines", required_argument, 0, 0},
 		{"output", required_argument, 0, 0},
 		{"anchor", required_argument, 0, 0},
 		{"sort", required_argument, 0, 0},
+		{"rate-limit", required_argument, 0, 0},
+		{"rate-limit-burst", required_argument, 0, 0},
+		{"rate-limit-action", required_argument, 0, 0},
+		{"preload-fonts", required_argument, 0, 0},
 		{0},
 	};
 
@@ -525,6 +663,9 @@ int parse_config_arguments(struct mako_config *config, int argc, char **argv) {
 			break;
 		} else if (c == 'h') {
 			return 1;
+		} else if (c == 't') {
+			config->timings = true;
+			continue;
 		} else if (c != 0) {
 			return -1;
 		}
@@ -540,32 +681,57 @@ int parse_config_arguments(struct mako_config *config, int argc, char **argv) {
 	return 0;
 }
 
-// Returns zero on success, negative on error, positive if we should exit
-// immediately due to something the user asked for (like help).
-int reload_config(struct mako_config *config, int argc, char **argv) {
-	struct mako_config new_config = {0};
-	init_default_config(&new_config);
+// Loads a complete config from the file and the arguments into `config`,
+// which must be uninitialized. It doesn't depend on any other state, so it can
+// run on any thread. Returns zero on success, negative on error, positive if
+// we should exit immediately due to something the user asked for (like help).
+// `config` is only initialized on success.
+int load_config(struct mako_config *config, int argc, char **argv) {
+	init_default_config(config);
 
-	if (load_config_file(&new_config) != 0) {
+	if (load_config_file(config) != 0) {
 		fprintf(stderr, "Failed to reload config\n");
-		finish_config(&new_config);
+		finish_config(config);
 		return -1;
 	}
 
-	int ret = parse_config_arguments(&new_config, argc, argv);
+	int ret = parse_config_arguments(config, argc, argv);
 	if (ret != 0) {
+		finish_config(config);
 		return ret;
 	}
-	apply_superset_style(&new_config.superstyle, &new_config);
 
+	if (!compile_criteria_keywords(config)) {
+		fprintf(stderr, "Failed to reload config\n");
+		finish_config(config);
+		return -1;
+	}
+	apply_superset_style(&config->superstyle, config);
+
+	return 0;
+}
+
+// Replaces `config` with `new_config`, which is moved and must not be used
+// anymore.
+void swap_config(struct mako_config *config, struct mako_config *new_config) {
 	finish_config(config);
-	*config = new_config;
+	*config = *new_config;
 
 	// We have to rebuild the wl_list that contains the criteria, as it is
-	// currently pointing to local memory instead of the location of the real
-	// criteria struct.
+	// currently pointing to the old location of the new config.
 	wl_list_init(&config->criteria);
-	wl_list_insert_list(&config->criteria, &new_config.criteria);
+	wl_list_insert_list(&config->criteria, &new_config->criteria);
+}
+
+// Returns zero on success, negative on error, positive if we should exit
+// immediately due to something the user asked for (like help).
+int reload_config(struct mako_config *config, int argc, char **argv) {
+	struct mako_config new_config = {0};
+	int ret = load_config(&new_config, argc, argv);
+	if (ret != 0) {
+		return ret;
+	}
 
+	swap_config(config, &new_config);
 	return 0;
 }
@@ -19,6 +19,9 @@ struct mako_criteria *create_criteria(struct mako_config *config) {
 		return NULL;
 	}
 
+	criteria->summary_keyword = -1;
+	criteria->body_keyword = -1;
+
 	wl_list_insert(config->criteria.prev, &criteria->link);
 	return criteria;
 }
@@ -31,11 +34,28 @@ void destroy_criteria(struct mako_criteria *criteria) {
 	free(criteria->app_icon);
 	free(criteria->category);
 	free(criteria->desktop_entry);
+	free(criteria->summary_contains);
+	free(criteria->body_contains);
 	free(criteria);
 }
 
-bool match_criteria(struct mako_criteria *criteria,
-		struct mako_notification *notif) {
+// Keyword hits of the notification being matched, as filled by
+// match_keywords for its summary and body.
+struct keyword_hits {
+	const bool *summary;
+	const bool *body;
+};
+
+static bool match_contains(const char *needle, ssize_t keyword,
+		const char *haystack, const bool *hits) {
+	if (hits != NULL && keyword >= 0) {
+		return hits[keyword];
+	}
+	return strstr(haystack, needle) != NULL;
+}
+
+static bool match_criteria_hits(struct mako_criteria *criteria,
+		struct mako_notification *notif, const struct keyword_hits *hits) {
 	struct mako_criteria_spec spec = criteria->spec;
 
 	if (spec.app_name &&
@@ -58,6 +78,11 @@ bool match_criteria(struct mako_criteria *criteria,
 		return false;
 	}
 
+	if (spec.grouped &&
+			criteria->grouped != notification_is_grouped(notif)) {
+		return false;
+	}
+
 	if (spec.urgency &&
 			criteria->urgency != notif->urgency) {
 		return false;
@@ -73,17 +98,41 @@ bool match_criteria(struct mako_criteria *criteria,
 		return false;
 	}
 
+	if (spec.summary_contains &&
+			!match_contains(criteria->summary_contains,
+				criteria->summary_keyword, notif->summary, hits->summary)) {
+		return false;
+	}
+
+	if (spec.body_contains &&
+			!match_contains(criteria->body_contains,
+				criteria->body_keyword, notif->body, hits->body)) {
+		return false;
+	}
+
 	return true;
 }
 
+bool match_criteria(struct mako_criteria *criteria,
+		struct mako_notification *notif) {
+	// Without precomputed hits, substrings are searched for one by one.
+	struct keyword_hits hits = {0};
+	return match_criteria_hits(criteria, notif, &hits);
+}
+
 bool parse_criteria(const char *string, struct mako_criteria *criteria) {
 	// Create space to build up the current token that we're reading. We know
 	// that no single token can ever exceed the length of the entire criteria
-	// string, so that's a safe length to use for the buffer.
-	int token_max_length = strlen(string) + 1;
-	char token[token_max_length];
-	memset(token, 0, token_max_length);
+	// string, so that's a safe length to use for the buffer. It's on the heap,
+	// since criteria strings can come from any D-Bus client.
+	size_t token_max_length = strlen(string) + 1;
+	char *token = calloc(token_max_length, 1);
+	if (token == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
 	size_t token_location = 0;
+	bool ok = false;
 
 	enum mako_parse_state state = MAKO_PARSE_STATE_NORMAL;
 	const char *location = string;
@@ -125,7 +174,7 @@ bool parse_criteria(const char *string, struct mako_criteria *criteria) {
 				// New token, apply the old one and reset our state.
 				if (!apply_criteria_field(criteria, token)) {
 					// An error should have been printed already.
-					return false;
+					goto out;
 				}
 				memset(token, 0, token_max_length);
 				token_location = 0;
@@ -145,24 +194,23 @@ bool parse_criteria(const char *string, struct mako_criteria *criteria) {
 	if (state != MAKO_PARSE_STATE_NORMAL) {
 		if (state & MAKO_PARSE_STATE_QUOTE) {
 			fprintf(stderr, "Unmatched quote in criteria definition\n");
-			return false;
 		} else if (state & MAKO_PARSE_STATE_ESCAPE) {
 			fprintf(stderr, "Trailing backslash in criteria definition\n");
-			return false;
 		} else {
 			fprintf(stderr, "Got confused parsing criteria definition\n");
-			return false;
 		}
+		goto out;
 	}
 
 	// Apply the last token, which will be left in the buffer after we hit the
 	// final NULL. We know it's valid since we just checked for that.
-	if (!apply_criteria_field(criteria, token)) {
-		// An error should have been printed by this point, we don't need to.
-		return false;
-	}
+	// An error should have been printed by this point if it isn't, we don't
+	// need to.
+	ok = apply_criteria_field(criteria, token);
 
-	return true;
+out:
+	free(token);
+	return ok;
 }
 
 // Takes a token from the criteria string that looks like "key=value", figures
@@ -226,6 +274,14 @@ bool apply_criteria_field(struct mako_criteria *criteria, char *token) {
 			criteria->desktop_entry = strdup(value);
 			criteria->spec.desktop_entry = true;
 			return true;
+		} else if (strcmp(key, "summary-contains") == 0) {
+			criteria->summary_contains = strdup(value);
+			criteria->spec.summary_contains = true;
+			return true;
+		} else if (strcmp(key, "body-contains") == 0) {
+			criteria->body_contains = strdup(value);
+			criteria->spec.body_contains = true;
+			return true;
 		} else {
 			// Anything left must be one of the boolean fields, defined using
 			// standard syntax. Continue on.
@@ -248,6 +304,14 @@ bool apply_criteria_field(struct mako_criteria *criteria, char *token) {
 		}
 		criteria->spec.expiring = true;
 		return true;
+	} else if (strcmp(key, "grouped") == 0) {
+		if (!parse_boolean(value, &criteria->grouped)) {
+			fprintf(stderr, "Invalid value '%s' for boolean field '%s'\n",
+					value, key);
+			return false;
+		}
+		criteria->spec.grouped = true;
+		return true;
 	} else {
 		if (bare_key) {
 			fprintf(stderr, "Invalid boolean criteria field '%s'\n", key);
@@ -260,6 +324,37 @@ bool apply_criteria_field(struct mako_criteria *criteria, char *token) {
 	return true;
 }
 
+// Register the substrings of every *-contains criteria field with the config's
+// keyword matcher and build it, so that notifications can be checked against
+// all of them with a single scan of their summary and body.
+bool compile_criteria_keywords(struct mako_config *config) {
+	struct mako_keyword_matcher *keywords = &config->keywords;
+
+	struct mako_criteria *criteria;
+	wl_list_for_each(criteria, &config->criteria, link) {
+		// An empty substring matches anything, there's nothing to look for.
+		if (criteria->spec.summary_contains &&
+				criteria->summary_contains[0] != '\0') {
+			criteria->summary_keyword =
+				add_keyword(keywords, criteria->summary_contains);
+			if (criteria->summary_keyword < 0) {
+				return false;
+			}
+		}
+
+		if (criteria->spec.body_contains &&
+				criteria->body_contains[0] != '\0') {
+			criteria->body_keyword =
+				add_keyword(keywords, criteria->body_contains);
+			if (criteria->body_keyword < 0) {
+				return false;
+			}
+		}
+	}
+
+	return build_keyword_matcher(keywords);
+}
+
 // Retreive the global critiera from a given mako_config. This just so happens
 // to be the first criteria in the list.
 struct mako_criteria *global_criteria(struct mako_config *config) {
@@ -269,24 +364,44 @@ struct mako_criteria *global_criteria(struct mako_config *config) {
 }
 
 
-// Iterate through `criteria_list`, applying the style from each matching
-// criteria to `notif`. Returns the number of criteria that matched, or -1 if
-// a failure occurs.
-ssize_t apply_each_criteria(struct wl_list *criteria_list,
+// Iterate through the criteria of `config`, applying the style from each
+// matching criteria to `notif`. Returns the number of criteria that matched,
+// or -1 if a failure occurs.
+ssize_t apply_each_criteria(struct mako_config *config,
 		struct mako_notification *notif) {
+	// Look for all the keywords at once up front, so that the summary and body
+	// are only scanned once no matter how many criteria use them.
+	size_t keyword_count = config->keywords.keyword_count;
+	struct keyword_hits hits = {0};
+	bool *hit_flags = NULL;
+	if (keyword_count > 0) {
+		hit_flags = calloc(2 * keyword_count, sizeof(bool));
+		if (hit_flags == NULL) {
+			fprintf(stderr, "allocation failed\n");
+			return -1;
+		}
+		match_keywords(&config->keywords, notif->summary, hit_flags);
+		match_keywords(&config->keywords, notif->body,
+			hit_flags + keyword_count);
+		hits.summary = hit_flags;
+		hits.body = hit_flags + keyword_count;
+	}
+
 	ssize_t match_count = 0;
 
 	struct mako_criteria *criteria;
-	wl_list_for_each(criteria, criteria_list, link) {
-		if (!match_criteria(criteria, notif)) {
+	wl_list_for_each(criteria, &config->criteria, link) {
+		if (!match_criteria_hits(criteria, notif, &hits)) {
 			continue;
 		}
 		++match_count;
 
 		if (!apply_style(&notif->style, &criteria->style)) {
+			free(hit_flags);
 			return -1;
 		}
 	}
 
+	free(hit_flags);
 	return match_count;
 }
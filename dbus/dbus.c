@@ -1,21 +1,271 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "dbus.h"
 #include "mako.h"
+#include "timings.h"
+
+// Maximum number of requests run per iteration of the main event loop, so that
+// a client flooding the bus can't starve Wayland events and timers. The D-Bus
+// thread processes at most as many messages before checking for events.
+#define DBUS_PROCESS_BUDGET 32
+
+// Number of requests or events which can be waiting for the other thread.
+// When requests pile up, the D-Bus thread stops reading the bus, and further
+// messages wait in the socket.
+#define DBUS_QUEUE_SIZE 1024
 
 static const char *service_name = "org.freedesktop.Notifications";
 
+static void wake_thread(int fd) {
+	uint64_t value = 1;
+	if (write(fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+		fprintf(stderr, "failed to write to eventfd: %s\n", strerror(errno));
+	}
+}
+
+static void clear_wakeup(int fd) {
+	uint64_t value;
+	if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+		fprintf(stderr, "failed to read from eventfd: %s\n", strerror(errno));
+	}
+}
+
+// Called from D-Bus handlers, on the D-Bus thread. The bus is only processed
+// while both queues have room, and each message makes at most one request.
+void push_dbus_request(struct mako_state *state,
+		struct mako_dbus_request *req) {
+	struct mako_dbus_thread *thread = &state->dbus_thread;
+	bool pushed = spsc_queue_push(req->urgent ?
+		&thread->urgent_requests : &thread->requests, req);
+	assert(pushed);
+	(void)pushed;
+	thread->requests_pushed = true;
+}
+
+// Called on the main thread. The D-Bus thread never waits for the main thread
+// while it has events to send, so waiting for room here can't deadlock.
+void push_dbus_event(struct mako_state *state, struct mako_dbus_event *event) {
+	struct mako_dbus_thread *thread = &state->dbus_thread;
+	while (!spsc_queue_push(&thread->events, event)) {
+		wake_thread(thread->events_fd);
+		sched_yield();
+	}
+	wake_thread(thread->events_fd);
+}
+
+static bool requests_full(struct mako_dbus_thread *thread) {
+	return spsc_queue_full(&thread->requests) ||
+		spsc_queue_full(&thread->urgent_requests);
+}
+
+static void send_dbus_events(struct mako_state *state) {
+	struct mako_dbus_event *event;
+	while ((event = spsc_queue_pop(&state->dbus_thread.events)) != NULL) {
+		event->send(state->bus, event);
+	}
+}
+
+// Converts an absolute sd-bus timeout to a poll() timeout.
+static int get_poll_timeout(sd_bus *bus) {
+	uint64_t timeout_usec;
+	if (sd_bus_get_timeout(bus, &timeout_usec) < 0 ||
+			timeout_usec == UINT64_MAX) {
+		return -1;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t now_usec = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	if (timeout_usec <= now_usec) {
+		return 0;
+	}
+	// Round up, so that we don't wake up right before the timeout
+	uint64_t timeout_ms = (timeout_usec - now_usec + 999) / 1000;
+	return timeout_ms > INT32_MAX ? INT32_MAX : (int)timeout_ms;
+}
+
+static void *run_dbus_thread(void *data) {
+	struct mako_state *state = data;
+	struct mako_dbus_thread *thread = &state->dbus_thread;
+
+	bool pending = false;
+	while (!atomic_load(&thread->stopping)) {
+		send_dbus_events(state);
+
+		bool full = false;
+		pending = false;
+		for (int i = 0; ; ++i) {
+			if (requests_full(thread)) {
+				// Pairs with the fence in dispatch_dbus_requests: either it
+				// sees the flag, or we see the room it made.
+				atomic_store(&thread->requests_full, true);
+				atomic_thread_fence(memory_order_seq_cst);
+				full = requests_full(thread);
+				if (full) {
+					break;
+				}
+				atomic_store(&thread->requests_full, false);
+			}
+			if (i == DBUS_PROCESS_BUDGET) {
+				pending = true;
+				break;
+			}
+
+			int ret = sd_bus_process(state->bus, NULL);
+			if (ret < 0) {
+				fprintf(stderr, "failed to process bus: %s\n", strerror(-ret));
+				atomic_store(&thread->failed, true);
+				wake_thread(thread->requests_fd);
+				return NULL;
+			}
+			if (ret == 0) {
+				break;
+			}
+		}
+
+		if (thread->requests_pushed) {
+			thread->requests_pushed = false;
+			wake_thread(thread->requests_fd);
+		}
+
+		int events = sd_bus_get_events(state->bus);
+		if (events < 0) {
+			events = POLLIN;
+		}
+		if (full) {
+			events &= ~POLLIN;
+		}
+		struct pollfd fds[] = {
+			{ .fd = sd_bus_get_fd(state->bus), .events = events },
+			{ .fd = thread->events_fd, .events = POLLIN },
+		};
+		// sd-bus asks to be processed right away when it has messages queued,
+		// but those have to wait for room in the queue.
+		int timeout = pending ? 0 : get_poll_timeout(state->bus);
+		if (full && timeout == 0) {
+			timeout = -1;
+		}
+		if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+			fprintf(stderr, "failed to poll(): %s\n", strerror(errno));
+			atomic_store(&thread->failed, true);
+			wake_thread(thread->requests_fd);
+			return NULL;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			clear_wakeup(thread->events_fd);
+		}
+	}
+
+	return NULL;
+}
+
+// Runs the requests handed over by the D-Bus thread, on the main thread: all
+// of the urgent ones, such as new critical notifications, then a bounded
+// number of the others. Returns 1 if requests are left, 0 if not, and -1 if the D-Bus
+// thread failed.
+int dispatch_dbus_requests(uint32_t events, void *data) {
+	struct mako_state *state = data;
+	struct mako_dbus_thread *thread = &state->dbus_thread;
+
+	clear_wakeup(thread->requests_fd);
+
+	// Urgent requests which keep coming in while these run wait for the next
+	// iteration, so that this stays bounded.
+	struct mako_dbus_request *urgent[DBUS_QUEUE_SIZE];
+	size_t urgent_count = 0;
+	while (urgent_count < DBUS_QUEUE_SIZE) {
+		urgent[urgent_count] = spsc_queue_pop(&thread->urgent_requests);
+		if (urgent[urgent_count] == NULL) {
+			break;
+		}
+		++urgent_count;
+	}
+
+	struct mako_dbus_request *batch[DBUS_PROCESS_BUDGET];
+	size_t count = 0;
+	while (count < DBUS_PROCESS_BUDGET) {
+		batch[count] = spsc_queue_pop(&thread->requests);
+		if (batch[count] == NULL) {
+			break;
+		}
+		++count;
+	}
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_exchange(&thread->requests_full, false)) {
+		wake_thread(thread->events_fd);
+	}
+
+	for (size_t i = 0; i < urgent_count; ++i) {
+		urgent[i]->run(state, urgent[i]);
+	}
+	for (size_t i = 0; i < count; ++i) {
+		batch[i]->run(state, batch[i]);
+	}
+
+	if (atomic_load(&thread->failed)) {
+		return -1;
+	}
+	return count == DBUS_PROCESS_BUDGET ||
+		urgent_count == DBUS_QUEUE_SIZE ? 1 : 0;
+}
+
+static bool init_dbus_thread(struct mako_dbus_thread *thread) {
+	thread->requests_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	thread->events_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (thread->requests_fd < 0 || thread->events_fd < 0) {
+		fprintf(stderr, "failed to create eventfd: %s\n", strerror(errno));
+		return false;
+	}
+
+	if (!init_spsc_queue(&thread->requests, DBUS_QUEUE_SIZE)) {
+		return false;
+	}
+	if (!init_spsc_queue(&thread->urgent_requests, DBUS_QUEUE_SIZE)) {
+		return false;
+	}
+	if (!init_spsc_queue(&thread->events, DBUS_QUEUE_SIZE)) {
+		return false;
+	}
+	return true;
+}
+
 bool init_dbus(struct mako_state *state) {
 	int ret = 0;
+	struct mako_dbus_thread *thread = &state->dbus_thread;
 	state->bus = NULL;
 	state->xdg_slot = state->mako_slot = NULL;
+	thread->started = false;
+	thread->requests_fd = thread->events_fd = -1;
+	atomic_init(&thread->stopping, false);
+	atomic_init(&thread->failed, false);
+	atomic_init(&thread->requests_full, false);
+	thread->requests_pushed = false;
+	atomic_init(&state->last_id, 0);
+
+	if (!init_dbus_thread(thread)) {
+		goto error;
+	}
 
 	ret = sd_bus_open_user(&state->bus);
 	if (ret < 0) {
 		fprintf(stderr, "Failed to connect to system bus: %s\n", strerror(-ret));
 		goto error;
 	}
+	mark_timing("bus connection");
+
+	update_dbus_capabilities(state);
 
 	ret = init_dbus_xdg(state);
 	if (ret < 0) {
@@ -34,6 +284,15 @@ bool init_dbus(struct mako_state *state) {
 		fprintf(stderr, "Failed to acquire service name: %s\n", strerror(-ret));
 		goto error;
 	}
+	mark_timing("bus name");
+
+	ret = pthread_create(&thread->thread, NULL, run_dbus_thread, state);
+	if (ret != 0) {
+		fprintf(stderr, "Failed to start D-Bus thread: %s\n", strerror(ret));
+		goto error;
+	}
+	thread->started = true;
+	mark_timing("bus thread");
 
 	return true;
 
@@ -43,6 +302,43 @@ error:
 }
 
 void finish_dbus(struct mako_state *state) {
+	struct mako_dbus_thread *thread = &state->dbus_thread;
+	if (thread->started) {
+		atomic_store(&thread->stopping, true);
+		wake_thread(thread->events_fd);
+		pthread_join(thread->thread, NULL);
+		thread->started = false;
+	}
+
+	// The bus belongs to this thread again. Signals which weren't sent yet
+	// still are, but requests are dropped.
+	if (thread->events.items != NULL) {
+		if (state->bus != NULL) {
+			send_dbus_events(state);
+		}
+		finish_spsc_queue(&thread->events);
+	}
+	struct mako_spsc_queue *queues[] = {
+		&thread->urgent_requests,
+		&thread->requests,
+	};
+	for (size_t i = 0; i < sizeof(queues) / sizeof(queues[0]); ++i) {
+		if (queues[i]->items == NULL) {
+			continue;
+		}
+		struct mako_dbus_request *req;
+		while ((req = spsc_queue_pop(queues[i])) != NULL) {
+			req->destroy(req);
+		}
+		finish_spsc_queue(queues[i]);
+	}
+	if (thread->requests_fd >= 0) {
+		close(thread->requests_fd);
+	}
+	if (thread->events_fd >= 0) {
+		close(thread->events_fd);
+	}
+
 	sd_bus_slot_unref(state->xdg_slot);
 	sd_bus_slot_unref(state->mako_slot);
 	sd_bus_flush_close_unref(state->bus);
@@ -1,5 +1,6 @@
 #define _POSIX_C_SOURCE 200809L
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,48 +10,183 @@
 #include "dbus.h"
 #include "mako.h"
 #include "notification.h"
+#include "reload.h"
 #include "wayland.h"
 
 static const char *service_path = "/fr/emersion/Mako";
 static const char *service_interface = "fr.emersion.Mako";
 
-static int handle_dismiss_all_notifications(sd_bus_message *msg, void *data,
-		sd_bus_error *ret_error) {
-	struct mako_state *state = data;
+static void destroy_request(struct mako_dbus_request *req) {
+	free(req);
+}
+
+// Requests without arguments
+static struct mako_dbus_request *create_request(mako_dbus_request_func_t run) {
+	struct mako_dbus_request *req = calloc(1, sizeof(struct mako_dbus_request));
+	if (req == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return NULL;
+	}
+	req->run = run;
+	req->destroy = destroy_request;
+	return req;
+}
+
+// Replies, then hands `req` to the main thread.
+static int reply_and_push(struct mako_state *state, sd_bus_message *msg,
+		struct mako_dbus_request *req) {
+	int ret = sd_bus_reply_method_return(msg, "");
+	if (ret < 0) {
+		req->destroy(req);
+		return ret;
+	}
+	push_dbus_request(state, req);
+	return 0;
+}
 
+static void run_dismiss_all(struct mako_state *state,
+		struct mako_dbus_request *req) {
 	close_all_notifications(state, MAKO_NOTIFICATION_CLOSE_DISMISSED);
 	send_frame(state);
-
-	return sd_bus_reply_method_return(msg, "");
+	free(req);
 }
 
-static int handle_dismiss_last_notification(sd_bus_message *msg, void *data,
+static int handle_dismiss_all_notifications(sd_bus_message *msg, void *data,
 		sd_bus_error *ret_error) {
 	struct mako_state *state = data;
 
+	struct mako_dbus_request *req = create_request(run_dismiss_all);
+	if (req == NULL) {
+		return -ENOMEM;
+	}
+	return reply_and_push(state, msg, req);
+}
+
+static void run_dismiss_last(struct mako_state *state,
+		struct mako_dbus_request *req) {
+	free(req);
+
 	if (wl_list_empty(&state->notifications)) {
-		goto done;
+		return;
 	}
 
 	struct mako_notification *notif =
 		wl_container_of(state->notifications.next, notif, link);
 	close_notification(notif, MAKO_NOTIFICATION_CLOSE_DISMISSED);
 	send_frame(state);
+}
 
-done:
-	return sd_bus_reply_method_return(msg, "");
+static int handle_dismiss_last_notification(sd_bus_message *msg, void *data,
+		sd_bus_error *ret_error) {
+	struct mako_state *state = data;
+
+	struct mako_dbus_request *req = create_request(run_dismiss_last);
+	if (req == NULL) {
+		return -ENOMEM;
+	}
+	return reply_and_push(state, msg, req);
 }
 
-static int handle_invoke_action(sd_bus_message *msg, void *data,
+struct dismiss_matching_request {
+	struct mako_dbus_request base;
+	struct mako_criteria *criteria;
+};
+
+static void destroy_dismiss_matching_request(struct mako_dbus_request *base) {
+	struct dismiss_matching_request *req = wl_container_of(base, req, base);
+	destroy_criteria(req->criteria);
+	free(req);
+}
+
+static void run_dismiss_matching(struct mako_state *state,
+		struct mako_dbus_request *base) {
+	struct dismiss_matching_request *req = wl_container_of(base, req, base);
+
+	size_t count = wl_list_length(&state->notifications);
+	struct mako_notification **matches =
+		calloc(count, sizeof(struct mako_notification *));
+	if (count > 0 && matches == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		destroy_dismiss_matching_request(base);
+		return;
+	}
+
+	size_t match_count = 0;
+	struct mako_notification *notif;
+	wl_list_for_each(notif, &state->notifications, link) {
+		if (match_criteria(req->criteria, notif)) {
+			matches[match_count++] = notif;
+		}
+	}
+	destroy_dismiss_matching_request(base);
+
+	if (match_count > 0) {
+		close_notifications(state, matches, match_count,
+			MAKO_NOTIFICATION_CLOSE_DISMISSED);
+		send_frame(state);
+	}
+	free(matches);
+}
+
+// Dismisses every notification matching the criteria given in the same
+// format as in the config file, without brackets. They're all closed at once,
+// then rendered once. The criteria is parsed here, so that errors can be
+// replied to right away.
+static int handle_dismiss_matching(sd_bus_message *msg, void *data,
 		sd_bus_error *ret_error) {
 	struct mako_state *state = data;
 
-	const char *action_key;
-	int ret = sd_bus_message_read(msg, "s", &action_key);
+	const char *criteria_string;
+	int ret = sd_bus_message_read(msg, "s", &criteria_string);
 	if (ret < 0) {
 		return ret;
 	}
 
+	struct dismiss_matching_request *req =
+		calloc(1, sizeof(struct dismiss_matching_request));
+	if (req == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return -ENOMEM;
+	}
+	req->base.run = run_dismiss_matching;
+	req->base.destroy = destroy_dismiss_matching_request;
+
+	// This criteria isn't part of the config, so its substrings aren't in the
+	// config's keyword matcher and are looked for one by one.
+	req->criteria = calloc(1, sizeof(struct mako_criteria));
+	if (req->criteria == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		free(req);
+		return -ENOMEM;
+	}
+	wl_list_init(&req->criteria->link);
+	req->criteria->summary_keyword = -1;
+	req->criteria->body_keyword = -1;
+
+	if (!parse_criteria(criteria_string, req->criteria)) {
+		destroy_dismiss_matching_request(&req->base);
+		sd_bus_error_set_const(ret_error, "fr.emersion.Mako.InvalidCriteria",
+			"Unable to parse criteria");
+		return -1;
+	}
+
+	return reply_and_push(state, msg, &req->base);
+}
+
+struct invoke_action_request {
+	struct mako_dbus_request base;
+	char key[];
+};
+
+static void destroy_invoke_action_request(struct mako_dbus_request *base) {
+	struct invoke_action_request *req = wl_container_of(base, req, base);
+	free(req);
+}
+
+static void run_invoke_action(struct mako_state *state,
+		struct mako_dbus_request *base) {
+	struct invoke_action_request *req = wl_container_of(base, req, base);
+
 	if (wl_list_empty(&state->notifications)) {
 		goto done;
 	}
@@ -59,48 +195,300 @@ static int handle_invoke_action(sd_bus_message *msg, void *data,
 		wl_container_of(state->notifications.next, notif, link);
 	struct mako_action *action;
 	wl_list_for_each(action, &notif->actions, link) {
-		if (strcmp(action->key, action_key) == 0) {
+		if (strcmp(action->key, req->key) == 0) {
 			notify_action_invoked(action);
 			break;
 		}
 	}
 
 done:
-	return sd_bus_reply_method_return(msg, "");
+	destroy_invoke_action_request(base);
+}
+
+static int handle_invoke_action(sd_bus_message *msg, void *data,
+		sd_bus_error *ret_error) {
+	struct mako_state *state = data;
+
+	const char *action_key;
+	int ret = sd_bus_message_read(msg, "s", &action_key);
+	if (ret < 0) {
+		return ret;
+	}
+
+	size_t key_size = strlen(action_key) + 1;
+	struct invoke_action_request *req =
+		calloc(1, sizeof(struct invoke_action_request) + key_size);
+	if (req == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return -ENOMEM;
+	}
+	req->base.run = run_invoke_action;
+	req->base.destroy = destroy_invoke_action_request;
+	memcpy(req->key, action_key, key_size);
+
+	return reply_and_push(state, msg, &req->base);
+}
+
+// Reload is only replied to once the new config is in use, or failed to
+// load. The call is carried to the main thread and back without being
+// touched there.
+struct reload_request {
+	struct mako_dbus_request base;
+	sd_bus_message *msg;
+	struct mako_reload_waiter waiter;
+};
+
+struct reload_reply_event {
+	struct mako_dbus_event base;
+	sd_bus_message *msg;
+	bool ok;
+};
+
+static void destroy_reload_request(struct mako_dbus_request *base) {
+	struct reload_request *req = wl_container_of(base, req, base);
+	// Only called once the D-Bus thread is gone
+	sd_bus_message_unref(req->msg);
+	free(req);
+}
+
+static void send_reload_reply_event(sd_bus *bus,
+		struct mako_dbus_event *base) {
+	struct reload_reply_event *event = wl_container_of(base, event, base);
+
+	if (event->ok) {
+		sd_bus_reply_method_return(event->msg, "");
+	} else {
+		sd_bus_error error = SD_BUS_ERROR_NULL;
+		sd_bus_error_set_const(&error, "fr.emersion.Mako.InvalidConfig",
+			"Unable to parse configuration file");
+		sd_bus_reply_method_error(event->msg, &error);
+	}
+
+	sd_bus_message_unref(event->msg);
+	free(event);
+}
+
+static void reply_reload(struct mako_state *state,
+		struct mako_reload_waiter *waiter, bool ok) {
+	struct reload_request *req = wl_container_of(waiter, req, waiter);
+
+	struct reload_reply_event *event =
+		calloc(1, sizeof(struct reload_reply_event));
+	if (event == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		// The message has to be unreferenced on the D-Bus thread, so it's
+		// leaked instead.
+		free(req);
+		return;
+	}
+	event->base.send = send_reload_reply_event;
+	event->msg = req->msg;
+	event->ok = ok;
+	free(req);
+
+	push_dbus_event(state, &event->base);
+}
+
+static void run_reload(struct mako_state *state,
+		struct mako_dbus_request *base) {
+	struct reload_request *req = wl_container_of(base, req, base);
+	req->waiter.func = reply_reload;
+	reload(state, &req->waiter);
 }
 
 static int handle_reload(sd_bus_message *msg, void *data,
 		sd_bus_error *ret_error) {
 	struct mako_state *state = data;
 
-	if (reload_config(&state->config, state->argc, state->argv) != 0) {
-		sd_bus_error_set_const(
-				ret_error, "fr.emersion.Mako.InvalidConfig",
-				"Unable to parse configuration file");
-		return -1;
+	struct reload_request *req = calloc(1, sizeof(struct reload_request));
+	if (req == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return -ENOMEM;
 	}
+	req->base.run = run_reload;
+	req->base.destroy = destroy_reload_request;
+	req->msg = sd_bus_message_ref(msg);
 
-	struct mako_notification *notif;
-	wl_list_for_each(notif, &state->notifications, link) {
-		finish_style(&notif->style);
-		init_empty_style(&notif->style);
-		apply_each_criteria(&state->config.criteria, notif);
+	push_dbus_request(state, &req->base);
+	// Replied to later
+	return 0;
+}
+
+struct notify_batch_request {
+	struct mako_dbus_request base;
+	struct mako_notify_args *args;
+	size_t count;
+};
+
+static void destroy_notify_batch_request(struct mako_dbus_request *base) {
+	struct notify_batch_request *req = wl_container_of(base, req, base);
+	for (size_t i = 0; i < req->count; ++i) {
+		finish_notify_args(&req->args[i]);
+	}
+	free(req->args);
+	free(req);
+}
+
+static void run_notify_batch(struct mako_state *state,
+		struct mako_dbus_request *base) {
+	struct notify_batch_request *req = wl_container_of(base, req, base);
+
+	for (size_t i = 0; i < req->count; ++i) {
+		struct mako_notification *notif;
+		if (add_notification(state, &req->args[i], &notif) < 0) {
+			fprintf(stderr, "Failed to add notification %" PRIu32 "\n",
+				req->args[i].id);
+		}
 	}
 
-	send_frame(state);
+	destroy_notify_batch_request(base);
+	schedule_frame(state);
+}
+
+static int read_notify_batch(sd_bus_message *msg,
+		struct notify_batch_request *req) {
+	int ret = sd_bus_message_enter_container(msg, 'a', "(susssasa{sv}i)");
+	if (ret < 0) {
+		return ret;
+	}
+
+	size_t capacity = 0;
+	while (1) {
+		ret = sd_bus_message_enter_container(msg, 'r', "susssasa{sv}i");
+		if (ret < 0) {
+			return ret;
+		} else if (ret == 0) {
+			break;
+		}
+
+		if (req->count == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			struct mako_notify_args *args = realloc(req->args,
+				capacity * sizeof(struct mako_notify_args));
+			if (args == NULL) {
+				fprintf(stderr, "allocation failed\n");
+				return -ENOMEM;
+			}
+			req->args = args;
+		}
+
+		ret = read_notify_args(msg, &req->args[req->count++]);
+		if (ret < 0) {
+			return ret;
+		}
+
+		ret = sd_bus_message_exit_container(msg);
+		if (ret < 0) {
+			return ret;
+		}
+	}
 
-	return sd_bus_reply_method_return(msg, "");
+	return sd_bus_message_exit_container(msg);
+}
+
+// Takes an array of notifications in the arguments format of Notify, so that
+// high-volume senders can send them in one message. They're all added before
+// rendering once, and their IDs are returned in the same order. Like with
+// Notify, the IDs are allocated and replied with before the notifications are
+// added on the main thread.
+static int handle_notify_batch(sd_bus_message *msg, void *data,
+		sd_bus_error *ret_error) {
+	struct mako_state *state = data;
+
+	struct notify_batch_request *req =
+		calloc(1, sizeof(struct notify_batch_request));
+	if (req == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return -ENOMEM;
+	}
+	req->base.run = run_notify_batch;
+	req->base.destroy = destroy_notify_batch_request;
+
+	sd_bus_message *reply = NULL;
+	int ret = read_notify_batch(msg, req);
+	if (ret < 0) {
+		goto error;
+	}
+
+	ret = sd_bus_message_new_method_return(msg, &reply);
+	if (ret < 0) {
+		goto error;
+	}
+
+	ret = sd_bus_message_open_container(reply, 'a', "u");
+	if (ret < 0) {
+		goto error;
+	}
+
+	for (size_t i = 0; i < req->count; ++i) {
+		req->args[i].id = allocate_notification_id(state);
+		ret = sd_bus_message_append(reply, "u", req->args[i].id);
+		if (ret < 0) {
+			goto error;
+		}
+	}
+
+	ret = sd_bus_message_close_container(reply);
+	if (ret < 0) {
+		goto error;
+	}
+
+	ret = sd_bus_send(NULL, reply, NULL);
+	if (ret < 0) {
+		goto error;
+	}
+	sd_bus_message_unref(reply);
+
+	push_dbus_request(state, &req->base);
+	return 0;
+
+error:
+	sd_bus_message_unref(reply);
+	destroy_notify_batch_request(&req->base);
+	return ret;
 }
 
 static const sd_bus_vtable service_vtable[] = {
 	SD_BUS_VTABLE_START(0),
 	SD_BUS_METHOD("DismissAllNotifications", "", "", handle_dismiss_all_notifications, SD_BUS_VTABLE_UNPRIVILEGED),
 	SD_BUS_METHOD("DismissLastNotification", "", "", handle_dismiss_last_notification, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("DismissMatching", "s", "", handle_dismiss_matching, SD_BUS_VTABLE_UNPRIVILEGED),
 	SD_BUS_METHOD("InvokeAction", "s", "", handle_invoke_action, SD_BUS_VTABLE_UNPRIVILEGED),
 	SD_BUS_METHOD("Reload", "", "", handle_reload, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("NotifyBatch", "a(susssasa{sv}i)", "au", handle_notify_batch, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_SIGNAL("NotificationsClosed", "auu", 0),
 	SD_BUS_VTABLE_END
 };
 
+// Emits a single signal for all of the notifications closed at once, for the
+// batch-closed-signal option. It's queued on the bus like any other message.
+int notify_mako_notifications_closed(sd_bus *bus, const uint32_t *ids,
+		size_t count, enum mako_notification_close_reason reason) {
+	sd_bus_message *signal = NULL;
+	int ret = sd_bus_message_new_signal(bus, &signal, service_path,
+		service_interface, "NotificationsClosed");
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = sd_bus_message_append_array(signal, 'u', ids,
+		count * sizeof(uint32_t));
+	if (ret < 0) {
+		goto out;
+	}
+
+	ret = sd_bus_message_append(signal, "u", reason);
+	if (ret < 0) {
+		goto out;
+	}
+
+	ret = sd_bus_send(bus, signal, NULL);
+
+out:
+	sd_bus_message_unref(signal);
+	return ret;
+}
+
 int init_dbus_mako(struct mako_state *state) {
 	return sd_bus_add_object_vtable(state->bus, &state->mako_slot, service_path,
 		service_interface, service_vtable, state);
@@ -1,5 +1,6 @@
 #define _POSIX_C_SOURCE 200809L
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +10,7 @@
 #include "dbus.h"
 #include "mako.h"
 #include "notification.h"
+#include "rate-limit.h"
 #include "wayland.h"
 
 static const char *service_path = "/org/freedesktop/Notifications";
@@ -17,6 +19,7 @@ static const char *service_interface = "org.freedesktop.Notifications";
 static int handle_get_capabilities(sd_bus_message *msg, void *data,
 		sd_bus_error *ret_error) {
 	struct mako_state *state = data;
+	unsigned int capabilities = atomic_load(&state->dbus_capabilities);
 
 	sd_bus_message *reply = NULL;
 	int ret = sd_bus_message_new_method_return(msg, &reply);
@@ -29,21 +32,21 @@ static int handle_get_capabilities(sd_bus_message *msg, void *data,
 		return ret;
 	}
 
-	if (strstr(state->config.superstyle.format, "%b") != NULL) {
+	if (capabilities & MAKO_DBUS_CAPABILITY_BODY) {
 		ret = sd_bus_message_append(reply, "s", "body");
 		if (ret < 0) {
 			return ret;
 		}
 	}
 
-	if (state->config.superstyle.markup) {
+	if (capabilities & MAKO_DBUS_CAPABILITY_BODY_MARKUP) {
 		ret = sd_bus_message_append(reply, "s", "body-markup");
 		if (ret < 0) {
 			return ret;
 		}
 	}
 
-	if (state->config.superstyle.actions) {
+	if (capabilities & MAKO_DBUS_CAPABILITY_ACTIONS) {
 		ret = sd_bus_message_append(reply, "s", "actions");
 		if (ret < 0) {
 			return ret;
@@ -64,6 +67,22 @@ static int handle_get_capabilities(sd_bus_message *msg, void *data,
 	return 0;
 }
 
+// The capabilities depend on the config, which belongs to the main thread, so
+// they're published for the D-Bus thread whenever the config is loaded.
+void update_dbus_capabilities(struct mako_state *state) {
+	unsigned int capabilities = 0;
+	if (strstr(state->config.superstyle.format, "%b") != NULL) {
+		capabilities |= MAKO_DBUS_CAPABILITY_BODY;
+	}
+	if (state->config.superstyle.markup) {
+		capabilities |= MAKO_DBUS_CAPABILITY_BODY_MARKUP;
+	}
+	if (state->config.superstyle.actions) {
+		capabilities |= MAKO_DBUS_CAPABILITY_ACTIONS;
+	}
+	atomic_store(&state->dbus_capabilities, capabilities);
+}
+
 static void handle_notification_timer(void *data) {
 	struct mako_notification *notif = data;
 	notif->timer = NULL;
@@ -74,42 +93,282 @@ static void handle_notification_timer(void *data) {
 	send_frame(state);
 }
 
-static int handle_notify(sd_bus_message *msg, void *data,
-		sd_bus_error *ret_error) {
-	struct mako_state *state = data;
+static void restart_notification_timer(struct mako_state *state,
+		struct mako_notification *notif) {
+	destroy_timer(notif->timer);
+	notif->timer = NULL;
 
-	struct mako_notification *notif = create_notification(state);
-	if (notif == NULL) {
-		return -1;
+	int32_t expire_timeout = notif->requested_timeout;
+	if (expire_timeout < 0 || notif->style.ignore_timeout) {
+		expire_timeout = notif->style.default_timeout;
 	}
 
-	int ret = 0;
+	if (expire_timeout > 0) {
+		notif->timer = add_event_loop_timer(&state->event_loop, expire_timeout,
+			handle_notification_timer, notif);
+	}
+}
 
-	const char *app_name, *app_icon, *summary, *body;
-	uint32_t replaces_id;
-	ret = sd_bus_message_read(msg, "susss", &app_name, &replaces_id, &app_icon,
-		&summary, &body);
+static int read_urgency_hint(sd_bus_message *msg,
+		enum mako_notification_urgency *out) {
+	// Should be a byte but some clients (Chromium) send an uint32_t
+	const char *contents = NULL;
+	int ret = sd_bus_message_peek_type(msg, NULL, &contents);
 	if (ret < 0) {
 		return ret;
 	}
-	notif->app_name = strdup(app_name);
-	notif->app_icon = strdup(app_icon);
-	notif->summary = strdup(summary);
-	notif->body = strdup(body);
 
-	if (replaces_id > 0) {
+	if (strcmp(contents, "u") == 0) {
+		uint32_t urgency = 0;
+		ret = sd_bus_message_read(msg, "v", "u", &urgency);
+		if (ret < 0) {
+			return ret;
+		}
+		*out = urgency;
+	} else {
+		uint8_t urgency = 0;
+		ret = sd_bus_message_read(msg, "v", "y", &urgency);
+		if (ret < 0) {
+			return ret;
+		}
+		*out = urgency;
+	}
+	return 0;
+}
+
+// Applies the criteria to a new notification, and truncates its body.
+static int prepare_notification(struct mako_state *state,
+		struct mako_notification *notif) {
+	int match_count = apply_each_criteria(&state->config, notif);
+	if (match_count == -1) {
+		// We encountered an allocation failure or similar while applying
+		// criteria. The notification may be partially matched, but the worst
+		// case is that it has an empty style, so bail.
+		fprintf(stderr, "Failed to apply criteria\n");
+		return -1;
+	} else if (match_count == 0) {
+		// This should be impossible, since the global criteria is always
+		// present in a mako_config and matches everything.
+		fprintf(stderr, "Notification matched zero criteria?!\n");
+		return -1;
+	}
+
+	if (!limit_notification_body(notif)) {
+		return -1;
+	}
+	return 0;
+}
+
+// Prepares a new notification, then inserts it and starts its timer.
+static int show_notification(struct mako_state *state,
+		struct mako_notification *notif) {
+	if (prepare_notification(state, notif) < 0) {
+		return -1;
+	}
+
+	insert_notification(state, notif);
+	restart_notification_timer(state, notif);
+	return 0;
+}
+
+static char *format_merged_summary(uint32_t count, const char *name) {
+	const char *fmt = "%" PRIu32 " more from %s";
+	int len = snprintf(NULL, 0, fmt, count, name);
+	char *summary = malloc(len + 1);
+	if (summary == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return NULL;
+	}
+	snprintf(summary, len + 1, fmt, count, name);
+	return summary;
+}
+
+// Handles a notification over the rate limit of `bucket`, which isn't shown.
+// It is either dropped, or counted in a single notification standing for all
+// of those throttled since the bucket ran out, which its ID then refers to.
+// The sender already has the ID, so a dropped notification is reported as
+// closed right away.
+static int throttle_notification(struct mako_state *state,
+		struct mako_rate_bucket *bucket, struct mako_notification *notif,
+		struct mako_notification **out) {
+	struct mako_rate_limiter *limiter = &state->rate_limiter;
+
+	if (state->config.rate_limit_action == MAKO_RATE_LIMIT_ACTION_DROP) {
+		++limiter->dropped;
+		notify_notifications_closed(state, &notif, 1,
+			MAKO_NOTIFICATION_CLOSE_UNKNOWN);
+		*out = NULL;
+		return 0;
+	}
+
+	++limiter->merged;
+	++bucket->merged_count;
+
+	const char *name = notif->app_name[0] != '\0' ?
+		notif->app_name : bucket->key;
+	char *summary = format_merged_summary(bucket->merged_count, name);
+	if (summary == NULL) {
+		return -1;
+	}
+
+	struct mako_notification *merged = NULL;
+	if (bucket->merged_id > 0) {
+		merged = get_notification(state, bucket->merged_id);
+	}
+	if (merged != NULL) {
+		free(merged->summary);
+		merged->summary = summary;
+		add_notification_alias(merged, notif->id);
+		invalidate_notification(merged);
+		restart_notification_timer(state, merged);
+	} else {
+		// The sender was already given this notification's ID
+		merged = create_notification(state, notif->id);
+		if (merged == NULL) {
+			free(summary);
+			return -1;
+		}
+		merged->app_name = strdup(notif->app_name);
+		merged->app_icon = strdup("");
+		merged->summary = summary;
+		merged->body = strdup("");
+		merged->urgency = notif->urgency;
+		merged->requested_timeout = -1;
+
+		if (show_notification(state, merged) < 0) {
+			destroy_notification(merged);
+			return -1;
+		}
+		bucket->merged_id = merged->id;
+	}
+
+	*out = merged;
+	return 0;
+}
+
+// Counts another notification identical to `notif`, and restarts its timeout
+// as if it had just been received.
+static void stack_duplicate_notification(struct mako_state *state,
+		struct mako_notify_args *args, struct mako_notification *notif) {
+	++notif->count;
+	add_notification_alias(notif, args->id);
+	notif->requested_timeout = args->requested_timeout;
+	invalidate_notification(notif);
+	restart_notification_timer(state, notif);
+}
+
+// Takes the strings of `args` over, and adds the resulting notification
+// without rendering it. On success, the notification which needs to be shown
+// is stored in `out`. That is usually the new notification, but not if it was
+// a duplicate or throttled, in which case `out` may be NULL and `args->id`
+// refers to `out`. Runs on the main thread; the sender was already given
+// `args->id`.
+int add_notification(struct mako_state *state, struct mako_notify_args *args,
+		struct mako_notification **out) {
+	// Updates are never duplicates, even if their content didn't change.
+	bool deduplicate = state->config.deduplicate && args->replaces_id == 0;
+	uint64_t content_hash = 0;
+	if (deduplicate) {
+		content_hash = hash_notification_content(args->app_name,
+			args->summary, args->body);
+	}
+
+	struct mako_notification *notif = create_notification(state, args->id);
+	if (notif == NULL) {
+		return -1;
+	}
+
+	notif->app_name = args->app_name;
+	notif->app_icon = args->app_icon;
+	notif->summary = args->summary;
+	notif->body = args->body;
+	notif->category = args->category;
+	notif->desktop_entry = args->desktop_entry;
+	args->app_name = args->app_icon = args->summary = args->body = NULL;
+	args->category = args->desktop_entry = NULL;
+	notif->urgency = args->urgency;
+	notif->requested_timeout = args->requested_timeout;
+
+	for (size_t i = 0; i < args->action_count; ++i) {
+		struct mako_action *action = calloc(1, sizeof(struct mako_action));
+		if (action == NULL) {
+			fprintf(stderr, "allocation failed\n");
+			destroy_notification(notif);
+			return -1;
+		}
+		action->notification = notif;
+		action->key = args->actions[i].key;
+		action->title = args->actions[i].title;
+		args->actions[i].key = args->actions[i].title = NULL;
+		wl_list_insert(&notif->actions, &action->link);
+	}
+
+	// Duplicates are compared once truncated, like the notifications they
+	// may duplicate.
+	if (prepare_notification(state, notif) < 0) {
+		destroy_notification(notif);
+		return -1;
+	}
+
+	if (deduplicate) {
+		struct mako_notification *duplicate =
+			find_duplicate_notification(state, content_hash, notif);
+		if (duplicate != NULL) {
+			stack_duplicate_notification(state, args, duplicate);
+			destroy_notification(notif);
+			*out = duplicate;
+			return 0;
+		}
+	}
+
+	// Critical notifications are never throttled, and neither are updates,
+	// which would otherwise leave the notification they replace stale.
+	if (notif->urgency != MAKO_NOTIFICATION_URGENCY_HIGH &&
+			args->replaces_id == 0) {
+		struct mako_rate_bucket *bucket = take_rate_limit_token(
+			&state->rate_limiter, &state->config, args->sender,
+			notif->app_name);
+		if (bucket != NULL) {
+			int ret = throttle_notification(state, bucket, notif, out);
+			destroy_notification(notif);
+			return ret;
+		}
+	}
+
+	if (args->replaces_id > 0) {
 		struct mako_notification *replaces =
-			get_notification(state, replaces_id);
+			get_notification(state, args->replaces_id);
 		if (replaces) {
 			close_notification(replaces, MAKO_NOTIFICATION_CLOSE_REQUEST);
 		}
 	}
 
-	ret = sd_bus_message_enter_container(msg, 'a', "s");
+	insert_notification(state, notif);
+	restart_notification_timer(state, notif);
+	if (deduplicate) {
+		index_notification(notif, content_hash);
+	}
+
+	*out = notif;
+	return 0;
+}
+
+static char *dup_message_string(const char *s) {
+	char *copy = strdup(s);
+	if (copy == NULL) {
+		fprintf(stderr, "allocation failed\n");
+	}
+	return copy;
+}
+
+static int read_notify_actions(sd_bus_message *msg,
+		struct mako_notify_args *args) {
+	int ret = sd_bus_message_enter_container(msg, 'a', "s");
 	if (ret < 0) {
 		return ret;
 	}
 
+	size_t capacity = 0;
 	while (1) {
 		const char *action_key, *action_title;
 		ret = sd_bus_message_read(msg, "ss", &action_key, &action_title);
@@ -119,22 +378,32 @@ static int handle_notify(sd_bus_message *msg, void *data,
 			break;
 		}
 
-		struct mako_action *action = calloc(1, sizeof(struct mako_action));
-		if (action == NULL) {
-			return -1;
+		if (args->action_count == capacity) {
+			capacity = capacity ? capacity * 2 : 4;
+			struct mako_notify_action *actions = realloc(args->actions,
+				capacity * sizeof(struct mako_notify_action));
+			if (actions == NULL) {
+				fprintf(stderr, "allocation failed\n");
+				return -ENOMEM;
+			}
+			args->actions = actions;
 		}
-		action->notification = notif;
-		action->key = strdup(action_key);
-		action->title = strdup(action_title);
-		wl_list_insert(&notif->actions, &action->link);
-	}
 
-	ret = sd_bus_message_exit_container(msg);
-	if (ret < 0) {
-		return ret;
+		struct mako_notify_action *action = &args->actions[args->action_count];
+		action->key = dup_message_string(action_key);
+		action->title = dup_message_string(action_title);
+		++args->action_count;
+		if (action->key == NULL || action->title == NULL) {
+			return -ENOMEM;
+		}
 	}
 
-	ret = sd_bus_message_enter_container(msg, 'a', "{sv}");
+	return sd_bus_message_exit_container(msg);
+}
+
+static int read_notify_hints(sd_bus_message *msg,
+		struct mako_notify_args *args) {
+	int ret = sd_bus_message_enter_container(msg, 'a', "{sv}");
 	if (ret < 0) {
 		return ret;
 	}
@@ -154,42 +423,32 @@ static int handle_notify(sd_bus_message *msg, void *data,
 		}
 
 		if (strcmp(hint, "urgency") == 0) {
-			// Should be a byte but some clients (Chromium) send an uint32_t
-			const char *contents = NULL;
-			ret = sd_bus_message_peek_type(msg, NULL, &contents);
+			ret = read_urgency_hint(msg, &args->urgency);
 			if (ret < 0) {
 				return ret;
 			}
-
-			if (strcmp(contents, "u") == 0) {
-				uint32_t urgency = 0;
-				ret = sd_bus_message_read(msg, "v", "u", &urgency);
-				if (ret < 0) {
-					return ret;
-				}
-				notif->urgency = urgency;
-			} else {
-				uint8_t urgency = 0;
-				ret = sd_bus_message_read(msg, "v", "y", &urgency);
-				if (ret < 0) {
-					return ret;
-				}
-				notif->urgency = urgency;
-			}
 		} else if (strcmp(hint, "category") == 0) {
 			const char *category = NULL;
 			ret = sd_bus_message_read(msg, "v", "s", &category);
 			if (ret < 0) {
 				return ret;
 			}
-			notif->category = strdup(category);
+			free(args->category);
+			args->category = dup_message_string(category);
+			if (args->category == NULL) {
+				return -ENOMEM;
+			}
 		} else if (strcmp(hint, "desktop-entry") == 0) {
 			const char *desktop_entry = NULL;
 			ret = sd_bus_message_read(msg, "v", "s", &desktop_entry);
 			if (ret < 0) {
 				return ret;
 			}
-			notif->desktop_entry = strdup(desktop_entry);
+			free(args->desktop_entry);
+			args->desktop_entry = dup_message_string(desktop_entry);
+			if (args->desktop_entry == NULL) {
+				return -ENOMEM;
+			}
 		} else {
 			ret = sd_bus_message_skip(msg, "v");
 			if (ret < 0) {
@@ -203,66 +462,192 @@ static int handle_notify(sd_bus_message *msg, void *data,
 		}
 	}
 
-	ret = sd_bus_message_exit_container(msg);
+	return sd_bus_message_exit_container(msg);
+}
+
+// Copies the arguments of a Notify call out of `msg`, so that they can be
+// handed to the main thread. This is shared with fr.emersion.Mako.NotifyBatch,
+// whose items have the same format. On failure, `args` still needs to be
+// finished.
+int read_notify_args(sd_bus_message *msg, struct mako_notify_args *args) {
+	memset(args, 0, sizeof(struct mako_notify_args));
+	args->urgency = MAKO_NOTIFICATION_URGENCY_UNKNOWN;
+
+	const char *app_name, *app_icon, *summary, *body;
+	int ret = sd_bus_message_read(msg, "susss", &app_name,
+		&args->replaces_id, &app_icon, &summary, &body);
 	if (ret < 0) {
 		return ret;
 	}
 
-	int32_t requested_timeout;
-	ret = sd_bus_message_read(msg, "i", &requested_timeout);
+	const char *sender = sd_bus_message_get_sender(msg);
+	if (sender != NULL) {
+		args->sender = dup_message_string(sender);
+		if (args->sender == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	args->app_name = dup_message_string(app_name);
+	args->app_icon = dup_message_string(app_icon);
+	args->summary = dup_message_string(summary);
+	args->body = dup_message_string(body);
+	if (args->app_name == NULL || args->app_icon == NULL ||
+			args->summary == NULL || args->body == NULL) {
+		return -ENOMEM;
+	}
+
+	ret = read_notify_actions(msg, args);
 	if (ret < 0) {
 		return ret;
 	}
-	notif->requested_timeout = requested_timeout;
 
-	int match_count = apply_each_criteria(&state->config.criteria, notif);
-	if (match_count == -1) {
-		// We encountered an allocation failure or similar while applying
-		// criteria. The notification may be partially matched, but the worst
-		// case is that it has an empty style, so bail.
-		fprintf(stderr, "Failed to apply criteria\n");
-		return -1;
-	} else if (match_count == 0) {
-		// This should be impossible, since the global criteria is always
-		// present in a mako_config and matches everything.
-		fprintf(stderr, "Notification matched zero criteria?!\n");
-		return -1;
+	ret = read_notify_hints(msg, args);
+	if (ret < 0) {
+		return ret;
 	}
 
-	int32_t expire_timeout = notif->requested_timeout;
-	if (expire_timeout < 0 || notif->style.ignore_timeout) {
-		expire_timeout = notif->style.default_timeout;
+	return sd_bus_message_read(msg, "i", &args->requested_timeout);
+}
+
+void finish_notify_args(struct mako_notify_args *args) {
+	free(args->sender);
+	free(args->app_name);
+	free(args->app_icon);
+	free(args->summary);
+	free(args->body);
+	for (size_t i = 0; i < args->action_count; ++i) {
+		free(args->actions[i].key);
+		free(args->actions[i].title);
 	}
+	free(args->actions);
+	free(args->category);
+	free(args->desktop_entry);
+}
 
-	insert_notification(state, notif);
-	if (expire_timeout > 0) {
-		notif->timer = add_event_loop_timer(&state->event_loop, expire_timeout,
-			handle_notification_timer, notif);
+struct notify_request {
+	struct mako_dbus_request base;
+	struct mako_notify_args args;
+};
+
+static void destroy_notify_request(struct mako_dbus_request *base) {
+	struct notify_request *req = wl_container_of(base, req, base);
+	finish_notify_args(&req->args);
+	free(req);
+}
+
+static void run_notify_request(struct mako_state *state,
+		struct mako_dbus_request *base) {
+	struct notify_request *req = wl_container_of(base, req, base);
+
+	struct mako_notification *notif = NULL;
+	if (add_notification(state, &req->args, &notif) < 0) {
+		fprintf(stderr, "Failed to add notification %" PRIu32 "\n",
+			req->args.id);
 	}
 
-	send_frame(state);
+	// Critical notifications are shown right away, the rest can wait to be
+	// coalesced with other changes.
+	if (notif == NULL) {
+		// Nothing to show
+	} else if (notif->urgency == MAKO_NOTIFICATION_URGENCY_HIGH) {
+		send_frame(state);
+	} else {
+		schedule_frame(state);
+	}
 
-	return sd_bus_reply_method_return(msg, "u", notif->id);
+	destroy_notify_request(base);
 }
 
-static int handle_close_notification(sd_bus_message *msg, void *data,
+// Runs on the D-Bus thread. The notification is given its ID right away and
+// the sender gets its reply without waiting for the main thread, which adds
+// the notification later. If it ends up folded into another one, because it
+// was a duplicate or over the rate limit, the ID refers to that one instead.
+static int handle_notify(sd_bus_message *msg, void *data,
 		sd_bus_error *ret_error) {
 	struct mako_state *state = data;
 
-	uint32_t id;
-	int ret = sd_bus_message_read(msg, "u", &id);
+	struct notify_request *req = calloc(1, sizeof(struct notify_request));
+	if (req == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return -ENOMEM;
+	}
+	req->base.run = run_notify_request;
+	req->base.destroy = destroy_notify_request;
+
+	int ret = read_notify_args(msg, &req->args);
 	if (ret < 0) {
+		destroy_notify_request(&req->base);
 		return ret;
 	}
+	// Requests referring to an ID have to stay in order with the others, the
+	// ID might belong to a notification which is still waiting in the queue,
+	// or which was just closed. Only new critical notifications skip ahead.
+	req->base.urgent = req->args.replaces_id == 0 &&
+		req->args.urgency == MAKO_NOTIFICATION_URGENCY_HIGH;
+	req->args.id = allocate_notification_id(state);
+
+	ret = sd_bus_reply_method_return(msg, "u", req->args.id);
+	if (ret < 0) {
+		destroy_notify_request(&req->base);
+		return ret;
+	}
+
+	push_dbus_request(state, &req->base);
+	return 0;
+}
+
+struct close_request {
+	struct mako_dbus_request base;
+	uint32_t id;
+};
+
+static void destroy_close_request(struct mako_dbus_request *base) {
+	struct close_request *req = wl_container_of(base, req, base);
+	free(req);
+}
+
+static void run_close_request(struct mako_state *state,
+		struct mako_dbus_request *base) {
+	struct close_request *req = wl_container_of(base, req, base);
 
 	// TODO: check client
-	struct mako_notification *notif = get_notification(state, id);
+	struct mako_notification *notif = get_notification(state, req->id);
 	if (notif) {
 		close_notification(notif, MAKO_NOTIFICATION_CLOSE_REQUEST);
 		send_frame(state);
 	}
 
-	return sd_bus_reply_method_return(msg, "");
+	destroy_close_request(base);
+}
+
+static int handle_close_notification(sd_bus_message *msg, void *data,
+		sd_bus_error *ret_error) {
+	struct mako_state *state = data;
+
+	uint32_t id;
+	int ret = sd_bus_message_read(msg, "u", &id);
+	if (ret < 0) {
+		return ret;
+	}
+
+	struct close_request *req = calloc(1, sizeof(struct close_request));
+	if (req == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return -ENOMEM;
+	}
+	req->base.run = run_close_request;
+	req->base.destroy = destroy_close_request;
+	req->id = id;
+
+	ret = sd_bus_reply_method_return(msg, "");
+	if (ret < 0) {
+		free(req);
+		return ret;
+	}
+
+	push_dbus_request(state, &req->base);
+	return 0;
 }
 
 static int handle_get_server_information(sd_bus_message *msg, void *data,
@@ -291,12 +676,98 @@ int init_dbus_xdg(struct mako_state *state) {
 		service_interface, service_vtable, state);
 }
 
-void notify_notification_closed(struct mako_notification *notif,
+struct closed_event {
+	struct mako_dbus_event base;
+	enum mako_notification_close_reason reason;
+	bool batch_signal;
+	size_t count;
+	uint32_t ids[];
+};
+
+// Emits NotificationClosed for each of the notifications. All of the signals
+// are built before any is sent. They are written out as the D-Bus thread's loop
+// finds the socket writable, so that it never blocks here.
+static void send_closed_event(sd_bus *bus, struct mako_dbus_event *base) {
+	struct closed_event *event = wl_container_of(base, event, base);
+
+	sd_bus_message **signals = calloc(event->count, sizeof(sd_bus_message *));
+	if (signals == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		free(event);
+		return;
+	}
+
+	for (size_t i = 0; i < event->count; ++i) {
+		int ret = sd_bus_message_new_signal(bus, &signals[i],
+			service_path, service_interface, "NotificationClosed");
+		if (ret >= 0) {
+			ret = sd_bus_message_append(signals[i], "uu", event->ids[i],
+				event->reason);
+		}
+		if (ret < 0) {
+			fprintf(stderr, "failed to create signal: %s\n", strerror(-ret));
+			signals[i] = sd_bus_message_unref(signals[i]);
+		}
+	}
+
+	for (size_t i = 0; i < event->count; ++i) {
+		if (signals[i] != NULL) {
+			sd_bus_send(bus, signals[i], NULL);
+			sd_bus_message_unref(signals[i]);
+		}
+	}
+	free(signals);
+
+	if (event->batch_signal) {
+		notify_mako_notifications_closed(bus, event->ids, event->count,
+			event->reason);
+	}
+
+	free(event);
+}
+
+void notify_notifications_closed(struct mako_state *state,
+		struct mako_notification **notifs, size_t count,
 		enum mako_notification_close_reason reason) {
-	struct mako_state *state = notif->state;
+	// Senders of the notifications merged into these ones are told too
+	size_t id_count = count;
+	for (size_t i = 0; i < count; ++i) {
+		id_count += notifs[i]->alias_count;
+	}
 
-	sd_bus_emit_signal(state->bus, service_path, service_interface,
-		"NotificationClosed", "uu", notif->id, reason);
+	struct closed_event *event =
+		calloc(1, sizeof(struct closed_event) + id_count * sizeof(uint32_t));
+	if (event == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return;
+	}
+	event->base.send = send_closed_event;
+	event->reason = reason;
+	event->batch_signal = state->config.batch_closed_signal;
+	event->count = 0;
+	for (size_t i = 0; i < count; ++i) {
+		event->ids[event->count++] = notifs[i]->id;
+		for (size_t j = 0; j < notifs[i]->alias_count; ++j) {
+			event->ids[event->count++] = notifs[i]->aliases[j];
+		}
+	}
+
+	push_dbus_event(state, &event->base);
+}
+
+struct action_invoked_event {
+	struct mako_dbus_event base;
+	uint32_t id;
+	char *key;
+};
+
+static void send_action_invoked_event(sd_bus *bus,
+		struct mako_dbus_event *base) {
+	struct action_invoked_event *event = wl_container_of(base, event, base);
+	sd_bus_emit_signal(bus, service_path, service_interface,
+		"ActionInvoked", "us", event->id, event->key);
+	free(event->key);
+	free(event);
 }
 
 void notify_action_invoked(struct mako_action *action) {
@@ -307,6 +778,20 @@ void notify_action_invoked(struct mako_action *action) {
 
 	struct mako_state *state = action->notification->state;
 
-	sd_bus_emit_signal(state->bus, service_path, service_interface,
-		"ActionInvoked", "us", action->notification->id, action->key);
+	struct action_invoked_event *event =
+		calloc(1, sizeof(struct action_invoked_event));
+	if (event == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return;
+	}
+	event->base.send = send_action_invoked_event;
+	event->id = action->notification->id;
+	event->key = strdup(action->key);
+	if (event->key == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		free(event);
+		return;
+	}
+
+	push_dbus_event(state, &event->base);
 }
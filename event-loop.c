@@ -3,46 +3,179 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
 #include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "event-loop.h"
 
-void init_event_loop(struct mako_event_loop *loop, sd_bus *bus,
+// Maximum number of events read from epoll per iteration. Any others are
+// returned by the next call.
+#define MAX_EPOLL_EVENTS 16
+
+// Wayland events are read by the loop itself, since reading has to be
+// prepared before waiting.
+static int handle_wayland_events(uint32_t events, void *data) {
+	struct mako_event_loop *loop = data;
+	if (wl_display_read_events(loop->display) < 0) {
+		fprintf(stderr, "failed to read Wayland events: %s\n",
+			strerror(errno));
+		return -1;
+	}
+	wl_display_dispatch_pending(loop->display);
+	return 0;
+}
+
+static int handle_event_loop_timer(uint32_t events, void *data);
+
+bool init_event_loop(struct mako_event_loop *loop,
 		struct wl_display *display) {
-	loop->fds[MAKO_EVENT_DBUS] = (struct pollfd){
-		.fd = sd_bus_get_fd(bus),
-		.events = POLLIN,
-	};
-
-	loop->fds[MAKO_EVENT_WAYLAND] = (struct pollfd){
-		.fd = wl_display_get_fd(display),
-		.events = POLLIN,
-	};
-
-	loop->fds[MAKO_EVENT_TIMER] = (struct pollfd){
-		.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC),
-		.events = POLLIN,
-	};
-
-	loop->bus = bus;
 	loop->display = display;
+	loop->running = false;
+	loop->dispatching = false;
+	loop->next_timer = NULL;
 	wl_list_init(&loop->timers);
+	wl_list_init(&loop->idles);
+	wl_list_init(&loop->sources);
+	loop->timer_fd = -1;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		fprintf(stderr, "failed to create epoll FD: %s\n", strerror(errno));
+		return false;
+	}
+
+	loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (loop->timer_fd < 0) {
+		fprintf(stderr, "failed to create timer FD: %s\n", strerror(errno));
+		goto error;
+	}
+
+	loop->wayland_source = add_event_loop_fd(loop,
+		wl_display_get_fd(display), EPOLLIN, handle_wayland_events, loop);
+	if (loop->wayland_source == NULL) {
+		goto error;
+	}
+	if (add_event_loop_fd(loop, loop->timer_fd, EPOLLIN,
+			handle_event_loop_timer, loop) == NULL) {
+		goto error;
+	}
+
+	return true;
+
+error:
+	finish_event_loop(loop);
+	return false;
+}
+
+// Makes the loop call `func` whenever `fd` has some of `events` (EPOLLIN,
+// EPOLLOUT, ...) available. If it returns 1, it's called again on the next
+// iteration even if the FD isn't ready anymore, so that sources can do a
+// bounded amount of work at a time. The FD isn't owned by the loop.
+struct mako_event_source *add_event_loop_fd(struct mako_event_loop *loop,
+		int fd, uint32_t events, mako_event_loop_fd_func_t func, void *data) {
+	struct mako_event_source *source =
+		calloc(1, sizeof(struct mako_event_source));
+	if (source == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return NULL;
+	}
+	source->event_loop = loop;
+	source->fd = fd;
+	source->events = events;
+	source->func = func;
+	source->data = data;
+
+	struct epoll_event event = { .events = events, .data.ptr = source };
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		fprintf(stderr, "failed to add FD to epoll: %s\n", strerror(errno));
+		free(source);
+		return NULL;
+	}
+
+	wl_list_insert(loop->sources.prev, &source->link);
+	return source;
+}
+
+void update_event_loop_fd(struct mako_event_source *source, uint32_t events) {
+	if (source->events == events) {
+		return;
+	}
+
+	struct epoll_event event = { .events = events, .data.ptr = source };
+	if (epoll_ctl(source->event_loop->epoll_fd, EPOLL_CTL_MOD, source->fd,
+			&event) < 0) {
+		fprintf(stderr, "failed to update FD in epoll: %s\n",
+			strerror(errno));
+		return;
+	}
+	source->events = events;
+}
+
+// Sources may be removed from callbacks, including other sources whose events
+// were already read, so they're only unlinked and freed once the iteration is
+// over.
+void remove_event_loop_fd(struct mako_event_source *source) {
+	if (source == NULL) {
+		return;
+	}
+
+	struct mako_event_loop *loop = source->event_loop;
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+	source->func = NULL;
+	if (!loop->dispatching) {
+		wl_list_remove(&source->link);
+		free(source);
+	}
+}
+
+static void free_removed_sources(struct mako_event_loop *loop) {
+	struct mako_event_source *source, *tmp;
+	wl_list_for_each_safe(source, tmp, &loop->sources, link) {
+		if (source->func == NULL) {
+			wl_list_remove(&source->link);
+			free(source);
+		}
+	}
 }
 
 void finish_event_loop(struct mako_event_loop *loop) {
-	close(loop->fds[MAKO_EVENT_TIMER].fd);
-	loop->fds[MAKO_EVENT_TIMER].fd = -1;
+	struct mako_event_source *source, *tmp_source;
+	wl_list_for_each_safe(source, tmp_source, &loop->sources, link) {
+		remove_event_loop_fd(source);
+	}
+	loop->wayland_source = NULL;
+
+	if (loop->timer_fd >= 0) {
+		close(loop->timer_fd);
+		loop->timer_fd = -1;
+	}
+	if (loop->epoll_fd >= 0) {
+		close(loop->epoll_fd);
+		loop->epoll_fd = -1;
+	}
 
 	struct mako_timer *timer, *tmp;
 	wl_list_for_each_safe(timer, tmp, &loop->timers, link) {
 		destroy_timer(timer);
 	}
+
+	struct mako_idle *idle, *tmp_idle;
+	wl_list_for_each_safe(idle, tmp_idle, &loop->idles, link) {
+		destroy_idle(idle);
+	}
 }
 
-static int poll_event_loop(struct mako_event_loop *loop) {
-	return poll(loop->fds, MAKO_EVENT_COUNT, -1);
+static bool has_pending_source(struct mako_event_loop *loop) {
+	struct mako_event_source *source;
+	wl_list_for_each(source, &loop->sources, link) {
+		if (source->pending) {
+			return true;
+		}
+	}
+	return false;
 }
 
 static void timespec_add(struct timespec *t, int delta_ms) {
@@ -68,7 +201,7 @@ static bool timespec_less(struct timespec *t1, struct timespec *t2) {
 }
 
 static void update_event_loop_timer(struct mako_event_loop *loop) {
-	int timer_fd = loop->fds[MAKO_EVENT_TIMER].fd;
+	int timer_fd = loop->timer_fd;
 	if (timer_fd < 0) {
 		return;
 	}
@@ -114,33 +247,47 @@ struct mako_timer *add_event_loop_timer(struct mako_event_loop *loop,
 }
 
 void destroy_timer(struct mako_timer *timer) {
-	if (timer == NULL) {
-		return;
-	}
-	struct mako_event_loop *loop = timer->event_loop;
+	destroy_timers(&timer, 1);
+}
 
-	if (loop->next_timer == timer) {
-		loop->next_timer = NULL;
-	}
+// Destroys `count` timers, some of which may be NULL. The remaining timers are
+// only searched for the next one to fire if it was among them.
+void destroy_timers(struct mako_timer **timers, size_t count) {
+	struct mako_event_loop *loop = NULL;
+	bool next_destroyed = false;
+	for (size_t i = 0; i < count; ++i) {
+		struct mako_timer *timer = timers[i];
+		if (timer == NULL) {
+			continue;
+		}
+		loop = timer->event_loop;
 
-	wl_list_remove(&timer->link);
-	free(timer);
+		if (loop->next_timer == timer) {
+			loop->next_timer = NULL;
+			next_destroyed = true;
+		}
 
-	update_event_loop_timer(loop);
+		wl_list_remove(&timer->link);
+		free(timer);
+	}
+
+	if (next_destroyed) {
+		update_event_loop_timer(loop);
+	}
 }
 
-static void handle_event_loop_timer(struct mako_event_loop *loop) {
-	int timer_fd = loop->fds[MAKO_EVENT_TIMER].fd;
+static int handle_event_loop_timer(uint32_t events, void *data) {
+	struct mako_event_loop *loop = data;
 	uint64_t expirations;
-	ssize_t n = read(timer_fd, &expirations, sizeof(expirations));
+	ssize_t n = read(loop->timer_fd, &expirations, sizeof(expirations));
 	if (n < 0) {
 		fprintf(stderr, "failed to read from timer FD\n");
-		return;
+		return 0;
 	}
 
 	struct mako_timer *timer = loop->next_timer;
 	if (timer == NULL) {
-		return;
+		return 0;
 	}
 
 	mako_event_loop_timer_func_t func = timer->func;
@@ -148,11 +295,78 @@ static void handle_event_loop_timer(struct mako_event_loop *loop) {
 	destroy_timer(timer);
 
 	func(user_data);
+	return 0;
+}
+
+// Idles run one per iteration, so that events which come up in the meantime
+// aren't kept waiting for all of them.
+struct mako_idle *add_event_loop_idle(struct mako_event_loop *loop,
+		mako_event_loop_idle_func_t func, void *data) {
+	struct mako_idle *idle = calloc(1, sizeof(struct mako_idle));
+	if (idle == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return NULL;
+	}
+	idle->event_loop = loop;
+	idle->func = func;
+	idle->user_data = data;
+	wl_list_insert(loop->idles.prev, &idle->link);
+	return idle;
+}
+
+void destroy_idle(struct mako_idle *idle) {
+	wl_list_remove(&idle->link);
+	free(idle);
+}
+
+static void run_event_loop_idle(struct mako_event_loop *loop) {
+	struct mako_idle *idle = wl_container_of(loop->idles.next, idle, link);
+	mako_event_loop_idle_func_t func = idle->func;
+	void *user_data = idle->user_data;
+	destroy_idle(idle);
+
+	func(user_data);
+}
+
+// Calls the sources which are ready, or left work for this iteration. Each of
+// them gets a bounded amount of work, in turn.
+static int dispatch_event_loop(struct mako_event_loop *loop,
+		struct epoll_event *events, int count) {
+	for (int i = 0; i < count; ++i) {
+		struct mako_event_source *source = events[i].data.ptr;
+		source->ready = events[i].events;
+	}
+
+	loop->dispatching = true;
+	int ret = 0;
+	struct mako_event_source *source;
+	wl_list_for_each(source, &loop->sources, link) {
+		if (source->func == NULL || (!source->ready && !source->pending)) {
+			continue;
+		}
+		uint32_t ready = source->ready;
+		source->ready = 0;
+		ret = source->func(ready, source->data);
+		if (ret < 0) {
+			break;
+		}
+		source->pending = ret > 0;
+		ret = 0;
+	}
+
+	// If a source failed, the ones after it are still marked as ready
+	wl_list_for_each(source, &loop->sources, link) {
+		source->ready = 0;
+	}
+	loop->dispatching = false;
+	free_removed_sources(loop);
+	return ret;
 }
 
 int run_event_loop(struct mako_event_loop *loop) {
 	loop->running = true;
 
+	struct epoll_event events[MAX_EPOLL_EVENTS];
 	int ret = 0;
 	while (loop->running) {
 		while (wl_display_prepare_read(loop->display) != 0) {
@@ -160,65 +374,51 @@ int run_event_loop(struct mako_event_loop *loop) {
 		}
 		wl_display_flush(loop->display);
 
-		ret = poll_event_loop(loop);
+		// If a source ran out of budget last time, there is work left to do,
+		// so just check for other events without waiting. The same goes for
+		// idles, which run if there are none.
+		bool busy = has_pending_source(loop);
+		int count = epoll_wait(loop->epoll_fd, events, MAX_EPOLL_EVENTS,
+			busy || !wl_list_empty(&loop->idles) ? 0 : -1);
 		if (!loop->running) {
 			wl_display_cancel_read(loop->display);
 			ret = 0;
 			break;
 		}
-		if (ret < 0) {
+		if (count < 0) {
 			wl_display_cancel_read(loop->display);
-			fprintf(stderr, "failed to poll(): %s\n", strerror(-ret));
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "failed to epoll_wait(): %s\n", strerror(errno));
+			ret = -1;
 			break;
 		}
 
-		if (!(loop->fds[MAKO_EVENT_WAYLAND].revents & POLLIN)) {
-			wl_display_cancel_read(loop->display);
-		}
-
-		if (loop->fds[MAKO_EVENT_DBUS].revents & POLLIN) {
-			while (1) {
-				ret = sd_bus_process(loop->bus, NULL);
-				if (ret < 0) {
-					fprintf(stderr, "failed to process bus: %s\n",
-						strerror(-ret));
-					break;
-				}
-				if (ret == 0) {
-					break;
-				}
-				// We processed a request, try to process another one, right-away
-			}
-
-			if (ret < 0) {
-				break;
+		bool wayland_ready = false;
+		for (int i = 0; i < count; ++i) {
+			if (events[i].data.ptr == loop->wayland_source) {
+				wayland_ready = true;
 			}
 		}
+		if (!wayland_ready) {
+			wl_display_cancel_read(loop->display);
+		}
 
-		if (loop->fds[MAKO_EVENT_WAYLAND].revents & POLLIN) {
-			ret = wl_display_read_events(loop->display);
-			if (ret < 0) {
-				fprintf(stderr, "failed to read Wayland events: %s\n",
-					strerror(errno));
-				break;
-			}
-			wl_display_dispatch_pending(loop->display);
+		ret = dispatch_event_loop(loop, events, count);
+		if (ret < 0) {
+			break;
 		}
 
-		if (loop->fds[MAKO_EVENT_TIMER].revents & POLLIN) {
-			handle_event_loop_timer(loop);
+		if (count == 0 && !busy && !wl_list_empty(&loop->idles)) {
+			run_event_loop_idle(loop);
 		}
 	}
 	return ret;
 }
 
-static void handle_stop_event_loop_timer(void *data) {
-	// No-op
-}
-
+// Only called from the loop's own callbacks, which return to it right away,
+// so there's no need to wake it up.
 void stop_event_loop(struct mako_event_loop *loop) {
 	loop->running = false;
-
-	// Wake up the event loop
-	add_event_loop_timer(loop, 0, handle_stop_event_loop_timer, NULL);
 }
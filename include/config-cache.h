@@ -0,0 +1,24 @@
+#ifndef _MAKO_CONFIG_CACHE_H
+#define _MAKO_CONFIG_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+// Identifies the contents of a config file. The cache is only used when the
+// file it was made from still has the same stamp.
+struct mako_config_source {
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t size;
+	uint64_t hash;
+};
+
+bool read_config_source(const char *path, struct mako_config_source *out);
+bool load_config_cache(struct mako_config *config, const char *path,
+	const struct mako_config_source *source);
+void save_config_cache(struct mako_config *config, const char *path,
+	const struct mako_config_source *source);
+
+#endif
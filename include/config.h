@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <wayland-client.h>
 
+#include "keyword-matcher.h"
 #include "types.h"
 
 enum mako_button_binding {
@@ -14,6 +15,16 @@ enum mako_button_binding {
 	MAKO_BUTTON_BINDING_INVOKE_DEFAULT_ACTION,
 };
 
+enum mako_rate_limit_action {
+	MAKO_RATE_LIMIT_ACTION_DROP,
+	MAKO_RATE_LIMIT_ACTION_MERGE,
+};
+
+enum mako_group_by {
+	MAKO_GROUP_BY_NONE,
+	MAKO_GROUP_BY_APP_NAME,
+};
+
 enum mako_sort_criteria {
 	MAKO_SORT_CRITERIA_TIME = 1,
 	MAKO_SORT_CRITERIA_URGENCY = 2,
@@ -24,7 +35,8 @@ enum mako_sort_criteria {
 // structs are also mirrored.
 struct mako_style_spec {
 	bool width, height, margin, padding, border_size, font, markup, format,
-		 actions, default_timeout, ignore_timeout;
+		 actions, default_timeout, ignore_timeout, max_body_length, max_lines,
+		 group;
 
 	struct {
 		bool background, text, border;
@@ -43,11 +55,17 @@ struct mako_style {
 	char *font;
 	bool markup;
 	char *format;
+	struct mako_format_program format_program; // Compiled from format
 
 	bool actions;
 	int default_timeout; // in ms
 	bool ignore_timeout;
 
+	int max_body_length; // in characters, 0 for no limit
+	int max_lines; // 0 for no limit
+
+	char *group; // Group key, overriding the config's group_by if not empty
+
 	struct {
 		uint32_t background;
 		uint32_t text;
@@ -57,19 +75,33 @@ struct mako_style {
 
 struct mako_config {
 	struct wl_list criteria; // mako_criteria::link
+	struct mako_keyword_matcher keywords; // For the *-contains criteria
 
 	int32_t max_visible;
+	int max_notifications; // 0 for no limit
+	int max_notifications_bytes; // 0 for no limit
+	bool deduplicate;
+	enum mako_group_by group_by;
+	bool batch_closed_signal;
 	char *output;
 	uint32_t anchor;
 	uint32_t sort_criteria; //enum mako_sort_criteria
 	uint32_t sort_asc;
 
+	int rate_limit; // notifications per second, 0 for no limit
+	int rate_limit_burst;
+	enum mako_rate_limit_action rate_limit_action;
+
+	bool preload_fonts; // Load fonts and render glyphs while idle
+
 	struct mako_style hidden_style;
 	struct mako_style superstyle;
 
 	struct {
 		enum mako_button_binding left, right, middle;
 	} button_bindings;
+
+	bool timings; // Print how long starting up took, command line only
 };
 
 void init_default_config(struct mako_config *config);
@@ -83,7 +115,10 @@ bool apply_superset_style(
 		struct mako_style *target, struct mako_config *config);
 
 int parse_config_arguments(struct mako_config *config, int argc, char **argv);
+char *get_config_path(void);
 int load_config_file(struct mako_config *config);
+int load_config(struct mako_config *config, int argc, char **argv);
+void swap_config(struct mako_config *config, struct mako_config *new_config);
 int reload_config(struct mako_config *config, int argc, char **argv);
 
 #endif
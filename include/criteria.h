@@ -20,6 +20,9 @@ struct mako_criteria_spec {
 	bool urgency;
 	bool category;
 	bool desktop_entry;
+	bool summary_contains;
+	bool body_contains;
+	bool grouped;
 };
 
 struct mako_criteria {
@@ -34,10 +37,18 @@ struct mako_criteria {
 	char *app_icon;
 	bool actionable; // Whether mako_notification.actions is nonempty
 	bool expiring; // Whether mako_notification.requested_timeout is non-zero
+	bool grouped; // Whether the notification's group has other notifications
 
 	enum mako_notification_urgency urgency;
 	char *category;
 	char *desktop_entry;
+
+	// Substrings to look for. Their index in the config's keyword matcher is
+	// assigned by compile_criteria_keywords, or -1 if they aren't part of it.
+	char *summary_contains;
+	char *body_contains;
+	ssize_t summary_keyword;
+	ssize_t body_keyword;
 };
 
 struct mako_criteria *create_criteria(struct mako_config *config);
@@ -48,8 +59,10 @@ bool match_criteria(struct mako_criteria *criteria,
 bool parse_criteria(const char *string, struct mako_criteria *criteria);
 bool apply_criteria_field(struct mako_criteria *criteria, char *token);
 
+bool compile_criteria_keywords(struct mako_config *config);
+
 struct mako_criteria *global_criteria(struct mako_config *config);
-ssize_t apply_each_criteria(struct wl_list *criteria_list,
+ssize_t apply_each_criteria(struct mako_config *config,
 		struct mako_notification *notif);
 
 #endif
@@ -1,23 +1,112 @@
 #ifndef _MAKO_DBUS_H
 #define _MAKO_DBUS_H
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <systemd/sd-bus.h>
 
+#include "spsc-queue.h"
+#include "types.h"
+
 struct mako_state;
 struct mako_notification;
 struct mako_action;
 enum mako_notification_close_reason;
 
+// The bus is owned by its own thread, so that replies don't wait for frames to
+// be rendered, and the other way around. sd-bus objects are only ever touched
+// from that thread. It talks to the main thread with plain data, through two
+// queues, each of them waking up the other side with an eventfd.
+struct mako_dbus_thread {
+	pthread_t thread;
+	bool started;
+	atomic_bool stopping;
+	atomic_bool failed; // The bus couldn't be processed, mako should exit
+
+	// D-Bus thread to main thread, mako_dbus_request. Urgent requests have
+	// their own queue, which is emptied first, so that they don't wait behind
+	// a flood of others.
+	struct mako_spsc_queue requests, urgent_requests;
+	int requests_fd;
+	// The D-Bus thread stopped reading the bus until there's room again
+	atomic_bool requests_full;
+	bool requests_pushed; // Only used by the D-Bus thread
+
+	// Main thread to D-Bus thread, mako_dbus_event
+	struct mako_spsc_queue events;
+	int events_fd;
+};
+
+struct mako_dbus_request;
+typedef void (*mako_dbus_request_func_t)(struct mako_state *state,
+	struct mako_dbus_request *req);
+
+// Work for the main thread, from a method call the D-Bus thread already
+// replied to (or will reply to once it gets a mako_dbus_event back).
+struct mako_dbus_request {
+	mako_dbus_request_func_t run; // Frees the request
+	void (*destroy)(struct mako_dbus_request *req); // If it never runs
+	// Run before the other requests waiting for the main thread. Only for
+	// requests which don't depend on the ones before them.
+	bool urgent;
+};
+
+struct mako_dbus_event;
+typedef void (*mako_dbus_event_func_t)(sd_bus *bus,
+	struct mako_dbus_event *event);
+
+// Work for the D-Bus thread: signals to emit, or deferred replies.
+struct mako_dbus_event {
+	mako_dbus_event_func_t send; // Frees the event
+};
+
+struct mako_notify_action {
+	char *key, *title;
+};
+
+// The arguments of a Notify call, copied out of the message.
+struct mako_notify_args {
+	uint32_t id; // Allocated by the D-Bus thread, which replied with it
+	char *sender;
+	char *app_name, *app_icon, *summary, *body;
+	uint32_t replaces_id;
+	struct mako_notify_action *actions;
+	size_t action_count;
+	enum mako_notification_urgency urgency;
+	char *category, *desktop_entry;
+	int32_t requested_timeout;
+};
+
+enum mako_dbus_capability {
+	MAKO_DBUS_CAPABILITY_BODY = 1 << 0,
+	MAKO_DBUS_CAPABILITY_BODY_MARKUP = 1 << 1,
+	MAKO_DBUS_CAPABILITY_ACTIONS = 1 << 2,
+};
+
 bool init_dbus(struct mako_state *state);
 void finish_dbus(struct mako_state *state);
-void notify_notification_closed(struct mako_notification *notif,
-	enum mako_notification_close_reason reason);
+void push_dbus_request(struct mako_state *state,
+	struct mako_dbus_request *req);
+void push_dbus_event(struct mako_state *state, struct mako_dbus_event *event);
+int dispatch_dbus_requests(uint32_t events, void *data);
 
+void notify_notifications_closed(struct mako_state *state,
+	struct mako_notification **notifs, size_t count,
+	enum mako_notification_close_reason reason);
 void notify_action_invoked(struct mako_action *action);
 
 int init_dbus_xdg(struct mako_state *state);
+void update_dbus_capabilities(struct mako_state *state);
+int read_notify_args(sd_bus_message *msg, struct mako_notify_args *args);
+void finish_notify_args(struct mako_notify_args *args);
+int add_notification(struct mako_state *state, struct mako_notify_args *args,
+	struct mako_notification **out);
 
 int init_dbus_mako(struct mako_state *state);
+int notify_mako_notifications_closed(sd_bus *bus, const uint32_t *ids,
+	size_t count, enum mako_notification_close_reason reason);
 
 #endif
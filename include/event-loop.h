@@ -1,27 +1,41 @@
 #ifndef _EVENT_LOOP_H
 #define _EVENT_LOOP_H
 
-#include <poll.h>
 #include <stdbool.h>
-#include <systemd/sd-bus.h>
+#include <stdint.h>
 #include <time.h>
 #include <wayland-client.h>
 
-enum mako_event {
-	MAKO_EVENT_DBUS,
-	MAKO_EVENT_WAYLAND,
-	MAKO_EVENT_TIMER,
-	MAKO_EVENT_COUNT, // keep last
+// `events` are the epoll events which are ready, or 0 if the source is only
+// called because it left work last time. Returns 1 if work is left for the
+// next iteration, 0 if not, -1 on error, which stops the loop.
+typedef int (*mako_event_loop_fd_func_t)(uint32_t events, void *data);
+
+struct mako_event_source {
+	struct mako_event_loop *event_loop;
+	int fd;
+	uint32_t events;
+	mako_event_loop_fd_func_t func;
+	void *data;
+	uint32_t ready; // Events read from epoll, during dispatch
+	bool pending; // Work was left over last iteration
+	struct wl_list link; // mako_event_loop::sources
 };
 
 struct mako_event_loop {
-	struct pollfd fds[MAKO_EVENT_COUNT];
-	sd_bus *bus;
+	int epoll_fd;
+	// mako_event_source::link, including removed ones while dispatching
+	struct wl_list sources;
+	bool dispatching;
+
 	struct wl_display *display;
+	struct mako_event_source *wayland_source;
 
 	bool running;
+	int timer_fd;
 	struct wl_list timers; // mako_timer::link
 	struct mako_timer *next_timer;
+	struct wl_list idles; // mako_idle::link, in the order they were added
 };
 
 typedef void (*mako_event_loop_timer_func_t)(void *data);
@@ -34,8 +48,22 @@ struct mako_timer {
 	struct wl_list link; // mako_event_loop::timers
 };
 
-void init_event_loop(struct mako_event_loop *loop, sd_bus *bus,
+typedef void (*mako_event_loop_idle_func_t)(void *data);
+
+// Work done once, when the loop has nothing else to do.
+struct mako_idle {
+	struct mako_event_loop *event_loop;
+	mako_event_loop_idle_func_t func;
+	void *user_data;
+	struct wl_list link; // mako_event_loop::idles
+};
+
+bool init_event_loop(struct mako_event_loop *loop,
 	struct wl_display *display);
+struct mako_event_source *add_event_loop_fd(struct mako_event_loop *loop,
+	int fd, uint32_t events, mako_event_loop_fd_func_t func, void *data);
+void update_event_loop_fd(struct mako_event_source *source, uint32_t events);
+void remove_event_loop_fd(struct mako_event_source *source);
 void finish_event_loop(struct mako_event_loop *loop);
 int run_event_loop(struct mako_event_loop *loop);
 void stop_event_loop(struct mako_event_loop *loop);
@@ -43,5 +71,9 @@ struct mako_timer *add_event_loop_timer(struct mako_event_loop *loop,
 	int delay_ms, mako_event_loop_timer_func_t func, void *data);
 
 void destroy_timer(struct mako_timer *timer);
+void destroy_timers(struct mako_timer **timers, size_t count);
+struct mako_idle *add_event_loop_idle(struct mako_event_loop *loop,
+	mako_event_loop_idle_func_t func, void *data);
+void destroy_idle(struct mako_idle *idle);
 
 #endif
@@ -0,0 +1,37 @@
+#ifndef _MAKO_KEYWORD_MATCHER_H
+#define _MAKO_KEYWORD_MATCHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// A node of the Aho-Corasick trie. Children are stored as a singly-linked
+// list of siblings, since most nodes only have a handful of them. Index 0 is
+// always the root, which is never anyone's child, so 0 doubles as "none".
+struct mako_keyword_node {
+	size_t child;
+	size_t sibling;
+	size_t fail;
+	size_t output; // Closest node along the fail chain ending a keyword
+	ssize_t keyword; // Keyword ending at this node, or -1
+	unsigned char ch;
+};
+
+// Matches any number of keywords against a string in a single pass. Keywords
+// are added one by one, then the automaton is built once, after which texts
+// can be scanned.
+struct mako_keyword_matcher {
+	struct mako_keyword_node *nodes;
+	size_t node_count, node_cap;
+	size_t keyword_count;
+	bool built;
+};
+
+void init_keyword_matcher(struct mako_keyword_matcher *matcher);
+void finish_keyword_matcher(struct mako_keyword_matcher *matcher);
+ssize_t add_keyword(struct mako_keyword_matcher *matcher, const char *keyword);
+bool build_keyword_matcher(struct mako_keyword_matcher *matcher);
+void match_keywords(const struct mako_keyword_matcher *matcher,
+	const char *text, bool *hits);
+
+#endif
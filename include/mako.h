@@ -1,22 +1,34 @@
 #ifndef _MAKO_H
 #define _MAKO_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <systemd/sd-bus.h>
 #include <wayland-client.h>
 
 #include "config.h"
+#include "dbus.h"
 #include "event-loop.h"
 #include "pool-buffer.h"
+#include "rate-limit.h"
+#include "reload.h"
+#include "worker-pool.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
 
+#define MAKO_DEDUP_INDEX_SIZE 64
+
 struct mako_state {
 	struct mako_config config;
+	struct mako_config_reload config_reload;
 	struct mako_event_loop event_loop;
+	int signal_fd;
 
-	sd_bus *bus;
+	sd_bus *bus; // Owned by the D-Bus thread
 	sd_bus_slot *xdg_slot, *mako_slot;
+	struct mako_dbus_thread dbus_thread;
+	atomic_uint dbus_capabilities; // mako_dbus_capability
 
 	struct wl_display *display;
 	struct wl_registry *registry;
@@ -37,9 +49,18 @@ struct mako_state {
 	int32_t width, height;
 	struct pool_buffer buffers[2];
 	struct pool_buffer *current_buffer;
+	struct mako_worker_pool layout_pool; // Lays out notifications in render
+	struct mako_timer *frame_timer; // Pending schedule_frame
+	struct mako_idle *font_preload; // Pending schedule_font_preload
+	struct mako_idle *prelayout; // Pending layout of hidden notifications
 
-	uint32_t last_id;
+	_Atomic uint32_t last_id; // Allocated from both threads
 	struct wl_list notifications; // mako_notification::link
+	size_t notification_count, notification_bytes;
+	// Notifications by hash of their content, for the deduplicate option
+	struct wl_list dedup_index[MAKO_DEDUP_INDEX_SIZE]; // mako_notification::dedup_link
+	struct wl_list groups; // mako_group::link
+	struct mako_rate_limiter rate_limiter;
 
 	int argc;
 	char **argv;
@@ -1,11 +1,13 @@
 #ifndef _MAKO_NOTIFICATION_H
 #define _MAKO_NOTIFICATION_H
 
+#include <pango/pangocairo.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <wayland-client.h>
 
 #include "config.h"
+#include "text.h"
 #include "types.h"
 
 struct mako_state;
@@ -16,13 +18,44 @@ struct mako_hotspot {
 	int32_t width, height;
 };
 
+// Formatted text split into plain text and Pango attributes. If the markup
+// couldn't be parsed, `fallback` is set and `text` is the markup itself.
+struct mako_parsed_text {
+	char *text;
+	PangoAttrList *attrs;
+	bool fallback;
+};
+
+// Notifications sharing a group key. Unless it is expanded, a group with more
+// than one notification is shown as a single tile, in place of its first
+// notification.
+struct mako_group {
+	struct wl_list link; // mako_state::groups
+	char *key;
+	bool by_app_name; // Whether the key is an app name or a group option
+	size_t count;
+	bool expanded;
+	bool seen; // Used while walking over the notifications
+	bool hidden; // Whether its tile is past max-visible, set with seen
+
+	// Set when notifications left the group, until it is updated
+	bool resized;
+	size_t old_count;
+};
+
 struct mako_notification {
 	struct mako_state *state;
 	struct wl_list link; // mako_state::notifications
+	struct wl_list dedup_link; // mako_state::dedup_index
 
 	struct mako_style style;
+	struct mako_group *group; // NULL if not grouped
 
 	uint32_t id;
+	// IDs which senders were given for notifications stacked or merged into
+	// this one, which refer to it too
+	uint32_t *aliases;
+	size_t alias_count, alias_capacity;
 	char *app_name;
 	char *app_icon;
 	char *summary;
@@ -34,8 +67,26 @@ struct mako_notification {
 	char *category;
 	char *desktop_entry;
 
+	uint64_t content_hash; // Of the app name, summary and body as received
+	uint32_t count; // Number of identical notifications received
+
 	struct mako_hotspot hotspot;
 	struct mako_timer *timer;
+
+	size_t size; // Memory accounted for in mako_state::notification_bytes
+
+	// Result of running the style's format on this notification and parsing
+	// its markup, kept until the notification is invalidated.
+	struct mako_text_buffer text;
+	struct mako_parsed_text parsed;
+	bool text_valid;
+
+	// Shaped text, kept as long as the text and the size, scale and subpixel
+	// order it was laid out for don't change.
+	PangoLayout *layout;
+	int layout_width, layout_height, layout_scale, layout_subpixel;
+	int layout_text_height;
+	bool layout_valid;
 };
 
 struct mako_action {
@@ -54,24 +105,54 @@ enum mako_notification_close_reason {
 
 #define DEFAULT_ACTION_KEY "default"
 
-typedef char *(*mako_format_func_t)(char variable, bool *markup, void *data);
+#define MAKO_FORMAT_SCRATCH_SIZE 32
+
+// Returns the value of a format specifier, or NULL if it isn't supported. The
+// returned string isn't owned by the caller. Values which have to be built on
+// the fly can be written to `scratch`, which is MAKO_FORMAT_SCRATCH_SIZE long.
+typedef const char *(*mako_format_func_t)(char variable, bool *markup,
+	char *scratch, void *data);
 
 bool hotspot_at(struct mako_hotspot *hotspot, int32_t x, int32_t y);
 
-struct mako_notification *create_notification(struct mako_state *state);
+bool notification_is_grouped(const struct mako_notification *notif);
+void reset_group_walk(struct mako_state *state);
+bool notification_is_collapsed(struct mako_notification *notif);
+size_t count_hidden_notifications(struct mako_state *state);
+
+uint32_t allocate_notification_id(struct mako_state *state);
+struct mako_notification *create_notification(struct mako_state *state,
+	uint32_t id);
 void destroy_notification(struct mako_notification *notif);
 void close_notification(struct mako_notification *notif,
 	enum mako_notification_close_reason reason);
+void close_notifications(struct mako_state *state,
+	struct mako_notification **notifs, size_t count,
+	enum mako_notification_close_reason reason);
 void close_all_notifications(struct mako_state *state,
 	enum mako_notification_close_reason reason);
-char *format_state_text(char variable, bool *markup, void *data);
-char *format_notif_text(char variable, bool *markup, void *data);
-size_t format_text(const char *format, char *buf, mako_format_func_t func, void *data);
+void invalidate_notification(struct mako_notification *notif);
+bool limit_notification_body(struct mako_notification *notif);
+void restyle_notifications(struct mako_state *state);
+const char *format_state_text(char variable, bool *markup, char *scratch,
+	void *data);
+const char *format_notif_text(char variable, bool *markup, char *scratch,
+	void *data);
+bool format_text(const struct mako_format_program *program,
+	struct mako_text_buffer *buf, mako_format_func_t func, void *data);
 struct mako_notification *get_notification(struct mako_state *state, uint32_t id);
-size_t format_notification(struct mako_notification *notif, const char *format,
-	char *buf);
+void add_notification_alias(struct mako_notification *notif, uint32_t id);
+const struct mako_parsed_text *format_notification(
+	struct mako_notification *notif);
+bool parse_text_markup(const char *markup, struct mako_parsed_text *out);
+void finish_parsed_text(struct mako_parsed_text *parsed);
 void notification_handle_button(struct mako_notification *notif, uint32_t button,
 	enum wl_pointer_button_state state);
 void insert_notification(struct mako_state *state, struct mako_notification *notif);
+uint64_t hash_notification_content(const char *app_name, const char *summary,
+	const char *body);
+void index_notification(struct mako_notification *notif, uint64_t hash);
+struct mako_notification *find_duplicate_notification(struct mako_state *state,
+	uint64_t hash, const struct mako_notification *notif);
 
 #endif
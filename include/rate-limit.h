@@ -0,0 +1,44 @@
+#ifndef _MAKO_RATE_LIMIT_H
+#define _MAKO_RATE_LIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <wayland-client.h>
+
+struct mako_config;
+
+enum mako_rate_bucket_type {
+	MAKO_RATE_BUCKET_SENDER,
+	MAKO_RATE_BUCKET_APP_NAME,
+};
+
+// A token bucket for a single D-Bus sender or application name. It holds up to
+// rate-limit-burst tokens and gains rate-limit tokens per second, every
+// notification taking one.
+struct mako_rate_bucket {
+	struct wl_list link; // mako_rate_limiter::buckets
+	enum mako_rate_bucket_type type;
+	char *key;
+	double tokens;
+	struct timespec last_refill;
+
+	uint64_t throttled;
+	uint32_t merged_id; // Notification the throttled ones are merged into
+	uint32_t merged_count;
+};
+
+struct mako_rate_limiter {
+	struct wl_list buckets; // mako_rate_bucket::link
+
+	uint64_t dropped;
+	uint64_t merged;
+};
+
+void init_rate_limiter(struct mako_rate_limiter *limiter);
+void finish_rate_limiter(struct mako_rate_limiter *limiter);
+struct mako_rate_bucket *take_rate_limit_token(
+	struct mako_rate_limiter *limiter, const struct mako_config *config,
+	const char *sender, const char *app_name);
+
+#endif
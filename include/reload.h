@@ -0,0 +1,59 @@
+#ifndef _MAKO_RELOAD_H
+#define _MAKO_RELOAD_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <wayland-client.h>
+
+#include "config.h"
+
+struct mako_state;
+struct mako_reload_waiter;
+
+typedef void (*mako_reload_func_t)(struct mako_state *state,
+	struct mako_reload_waiter *waiter, bool ok);
+
+// Someone to tell once a reload is done, such as a Reload method call.
+struct mako_reload_waiter {
+	mako_reload_func_t func;
+	struct wl_list link; // mako_config_reload::waiters, queued
+};
+
+// Watches the config file, and the directory it's in for editors which replace
+// the file instead of writing to it, to reload it automatically.
+struct mako_config_watch {
+	int fd; // inotify
+	struct mako_event_source *source;
+	char *path; // Config file being watched, NULL if there is none
+	const char *name; // Base name of path
+	int file_wd, dir_wd;
+	struct mako_timer *timer; // Debounces bursts of changes
+};
+
+// The config is parsed on a thread of its own, into a config separate from
+// the current one, which is then swapped in on the main thread. Only one
+// parse runs at a time. Reloads requested in the meantime wait for the next
+// one, since the file may have changed after it was read.
+struct mako_config_reload {
+	pthread_t thread;
+	bool running;
+	bool threaded; // False if the thread couldn't be started, and it ran inline
+	int fd; // Signalled by the thread once it's done
+	struct mako_event_source *source;
+
+	// Written by the thread, read once it's done
+	struct mako_config config;
+	int ret;
+
+	struct wl_list waiters; // mako_reload_waiter::link, for the running parse
+	struct wl_list queued; // mako_reload_waiter::link, for the next one
+	bool again; // Another parse was requested while one was running
+
+	struct mako_config_watch watch;
+};
+
+bool init_config_reload(struct mako_state *state);
+void finish_config_reload(struct mako_state *state);
+void reload(struct mako_state *state, struct mako_reload_waiter *waiter);
+
+#endif
@@ -4,5 +4,6 @@
 struct mako_state;
 
 int render(struct mako_state *state, struct pool_buffer *buffer, int scale);
+void schedule_font_preload(struct mako_state *state);
 
 #endif
@@ -0,0 +1,23 @@
+#ifndef _MAKO_SPSC_QUEUE_H
+#define _MAKO_SPSC_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A fixed-size ring of pointers between exactly one producer thread and one
+// consumer thread, without locks. Each side only writes its own index.
+struct mako_spsc_queue {
+	void **items;
+	size_t capacity; // Power of two
+	atomic_size_t head; // Next item to pop, written by the consumer
+	atomic_size_t tail; // Next slot to push to, written by the producer
+};
+
+bool init_spsc_queue(struct mako_spsc_queue *queue, size_t capacity);
+void finish_spsc_queue(struct mako_spsc_queue *queue);
+bool spsc_queue_push(struct mako_spsc_queue *queue, void *item);
+void *spsc_queue_pop(struct mako_spsc_queue *queue);
+bool spsc_queue_full(struct mako_spsc_queue *queue);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef _MAKO_TEXT_H
+#define _MAKO_TEXT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A growable, always NUL-terminated string. Resetting it keeps the allocated
+// memory around, so a buffer can be reused without going back to malloc.
+struct mako_text_buffer {
+	char *data;
+	size_t len; // Not including the NUL terminator
+	size_t size;
+};
+
+void init_text_buffer(struct mako_text_buffer *buf);
+void finish_text_buffer(struct mako_text_buffer *buf);
+void reset_text_buffer(struct mako_text_buffer *buf);
+bool text_buffer_reserve(struct mako_text_buffer *buf, size_t len);
+bool text_buffer_append(struct mako_text_buffer *buf, const char *s,
+	size_t len);
+bool text_buffer_append_escaped(struct mako_text_buffer *buf, const char *s,
+	size_t len);
+void text_buffer_trim(struct mako_text_buffer *buf);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _MAKO_TIMINGS_H
+#define _MAKO_TIMINGS_H
+
+#include <stdbool.h>
+
+// A timeline of the steps mako goes through while starting up, printed with
+// --timings. Steps are recorded from the start of main() until end_timings,
+// and marking them afterwards does nothing.
+void start_timings(void);
+void mark_timing(const char *step);
+void end_timings(bool print);
+
+#endif
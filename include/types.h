@@ -2,6 +2,7 @@
 #define _MAKO_TYPES_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 bool parse_boolean(const char *string, bool *out);
@@ -31,4 +32,28 @@ extern const char VALID_FORMAT_SPECIFIERS[];
 
 bool parse_format(const char *string, char **out);
 
+enum mako_format_op_type {
+	MAKO_FORMAT_OP_LITERAL,
+	MAKO_FORMAT_OP_SPECIFIER,
+};
+
+struct mako_format_op {
+	enum mako_format_op_type type;
+	char specifier;
+	size_t offset, len; // Span of a literal in mako_format_program::literals
+};
+
+// A format string split into a list of literal chunks and specifiers ahead of
+// time, so that formatting doesn't need to look for the specifiers again.
+struct mako_format_program {
+	char *literals;
+	struct mako_format_op *ops;
+	size_t op_count;
+};
+
+bool compile_format(const char *format, struct mako_format_program *out);
+bool copy_format_program(struct mako_format_program *dst,
+	const struct mako_format_program *src);
+void finish_format_program(struct mako_format_program *program);
+
 #endif
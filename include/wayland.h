@@ -32,5 +32,6 @@ struct mako_seat {
 bool init_wayland(struct mako_state *state);
 void finish_wayland(struct mako_state *state);
 void send_frame(struct mako_state *state);
+void schedule_frame(struct mako_state *state);
 
 #endif
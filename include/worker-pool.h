@@ -0,0 +1,34 @@
+#ifndef _MAKO_WORKER_POOL_H
+#define _MAKO_WORKER_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void (*mako_work_func_t)(void *item);
+
+// A fixed set of threads running batches of independent work items. Batches
+// are run one at a time, and the thread submitting a batch works on it too.
+struct mako_worker_pool {
+	pthread_t *threads;
+	size_t thread_count;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond; // A batch was submitted or the pool is stopping
+	pthread_cond_t done_cond; // A worker finished the last item of a batch
+
+	// Current batch, protected by the mutex
+	mako_work_func_t func;
+	void **items;
+	size_t item_count, next_item, done_count;
+	bool stopping;
+};
+
+bool init_worker_pool(struct mako_worker_pool *pool, size_t thread_count);
+void finish_worker_pool(struct mako_worker_pool *pool);
+void run_worker_pool(struct mako_worker_pool *pool, mako_work_func_t func,
+	void **items, size_t count);
+void run_worker_pool_on_each(struct mako_worker_pool *pool,
+	mako_work_func_t func, void *data);
+
+#endif
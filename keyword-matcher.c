@@ -0,0 +1,150 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keyword-matcher.h"
+
+static size_t new_node(struct mako_keyword_matcher *matcher, unsigned char ch) {
+	if (matcher->node_count == matcher->node_cap) {
+		size_t cap = matcher->node_cap ? matcher->node_cap * 2 : 64;
+		struct mako_keyword_node *nodes =
+			realloc(matcher->nodes, cap * sizeof(struct mako_keyword_node));
+		if (nodes == NULL) {
+			fprintf(stderr, "allocation failed\n");
+			return 0;
+		}
+		matcher->nodes = nodes;
+		matcher->node_cap = cap;
+	}
+
+	size_t index = matcher->node_count++;
+	matcher->nodes[index] = (struct mako_keyword_node){
+		.keyword = -1,
+		.ch = ch,
+	};
+	return index;
+}
+
+static size_t find_child(const struct mako_keyword_matcher *matcher,
+		size_t node, unsigned char ch) {
+	size_t child = matcher->nodes[node].child;
+	while (child != 0 && matcher->nodes[child].ch != ch) {
+		child = matcher->nodes[child].sibling;
+	}
+	return child;
+}
+
+void init_keyword_matcher(struct mako_keyword_matcher *matcher) {
+	memset(matcher, 0, sizeof(struct mako_keyword_matcher));
+}
+
+void finish_keyword_matcher(struct mako_keyword_matcher *matcher) {
+	free(matcher->nodes);
+	init_keyword_matcher(matcher);
+}
+
+// Adds `keyword` to the trie and returns its index, which is the position of
+// its flag in the `hits` array filled by match_keywords. Adding the same
+// keyword twice returns the same index. Returns -1 on failure.
+ssize_t add_keyword(struct mako_keyword_matcher *matcher, const char *keyword) {
+	if (matcher->node_count == 0) {
+		// The root, it doesn't match any character.
+		new_node(matcher, '\0');
+		if (matcher->node_count == 0) {
+			return -1;
+		}
+	}
+	matcher->built = false;
+
+	size_t node = 0;
+	for (const unsigned char *c = (const unsigned char *)keyword; *c; ++c) {
+		size_t child = find_child(matcher, node, *c);
+		if (child == 0) {
+			child = new_node(matcher, *c);
+			if (child == 0) {
+				return -1;
+			}
+			matcher->nodes[child].sibling = matcher->nodes[node].child;
+			matcher->nodes[node].child = child;
+		}
+		node = child;
+	}
+
+	if (matcher->nodes[node].keyword < 0) {
+		matcher->nodes[node].keyword = matcher->keyword_count++;
+	}
+	return matcher->nodes[node].keyword;
+}
+
+// Computes the failure and output links with a breadth-first walk of the trie,
+// so that every node's fail target (which is always shallower) is resolved
+// before the node itself.
+bool build_keyword_matcher(struct mako_keyword_matcher *matcher) {
+	if (matcher->node_count == 0) {
+		matcher->built = true;
+		return true;
+	}
+
+	size_t *queue = calloc(matcher->node_count, sizeof(size_t));
+	if (queue == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+
+	struct mako_keyword_node *nodes = matcher->nodes;
+	size_t head = 0, tail = 0;
+	for (size_t child = nodes[0].child; child != 0;
+			child = nodes[child].sibling) {
+		nodes[child].fail = 0;
+		nodes[child].output = 0;
+		queue[tail++] = child;
+	}
+
+	while (head < tail) {
+		size_t node = queue[head++];
+		for (size_t child = nodes[node].child; child != 0;
+				child = nodes[child].sibling) {
+			size_t fail = nodes[node].fail;
+			size_t next = find_child(matcher, fail, nodes[child].ch);
+			while (next == 0 && fail != 0) {
+				fail = nodes[fail].fail;
+				next = find_child(matcher, fail, nodes[child].ch);
+			}
+			nodes[child].fail = next;
+			nodes[child].output = nodes[next].keyword >= 0 ?
+				next : nodes[next].output;
+			queue[tail++] = child;
+		}
+	}
+
+	free(queue);
+	matcher->built = true;
+	return true;
+}
+
+// Scans `text` once and sets hits[i] for every keyword i found in it. `hits`
+// must have room for all the keywords of the matcher, and is not cleared.
+void match_keywords(const struct mako_keyword_matcher *matcher,
+		const char *text, bool *hits) {
+	if (!matcher->built || matcher->keyword_count == 0) {
+		return;
+	}
+
+	const struct mako_keyword_node *nodes = matcher->nodes;
+	size_t node = 0;
+	for (const unsigned char *c = (const unsigned char *)text; *c; ++c) {
+		size_t next = find_child(matcher, node, *c);
+		while (next == 0 && node != 0) {
+			node = nodes[node].fail;
+			next = find_child(matcher, node, *c);
+		}
+		node = next;
+
+		size_t out = nodes[node].keyword >= 0 ? node : nodes[node].output;
+		while (out != 0) {
+			hits[nodes[out].keyword] = true;
+			out = nodes[out].output;
+		}
+	}
+}
@@ -1,21 +1,29 @@
 #define _POSIX_C_SOURCE 200809L
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "dbus.h"
 #include "mako.h"
 #include "notification.h"
+#include "reload.h"
 #include "render.h"
+#include "timings.h"
 #include "wayland.h"
 
 static const char usage[] =
 	"Usage: mako [options...]\n"
 	"\n"
 	"  -h, --help                      Show help message and quit.\n"
+	"      --timings                   Print how long starting up took.\n"
 	"      --font <font>               Font family and size.\n"
 	"      --background-color <color>  Background color.\n"
 	"      --text-color <color>        Text color.\n"
@@ -31,23 +39,151 @@ static const char usage[] =
 	"      --format <format>           Format string.\n"
 	"      --hidden-format <format>    Format string.\n"
 	"      --max-visible <n>           Max number of visible notifications.\n"
+	"      --max-notifications <n>     Max number of notifications kept.\n"
+	"      --max-notifications-bytes <n>\n"
+	"                                  Max memory used by notifications.\n"
+	"      --deduplicate <0|1>         Stack identical notifications.\n"
+	"      --group-by <field>          Collapse notifications with the same\n"
+	"                                  field: none or app-name.\n"
+	"      --group <name>              Group key for notifications.\n"
+	"      --batch-closed-signal <0|1> Also signal closed notifications in\n"
+	"                                  batches.\n"
 	"      --default-timeout <timeout> Default timeout in milliseconds.\n"
+	"      --max-body-length <n>       Max number of characters in a body.\n"
+	"      --max-lines <n>             Max number of lines in a body.\n"
 	"      --output <name>             Show notifications on this output.\n"
 	"      --anchor <corner>           Corner of output to put notifications.\n"
+	"      --rate-limit <n>            Max notifications per second from a\n"
+	"                                  single sender or application.\n"
+	"      --rate-limit-burst <n>      Notifications allowed in a burst.\n"
+	"      --rate-limit-action <action>\n"
+	"                                  What to do with notifications over\n"
+	"                                  the limit: drop or merge.\n"
+	"      --preload-fonts <0|1>       Load fonts ahead of time.\n"
 	"\n"
 	"Colors can be specified with the format #RRGGBB or #RRGGBBAA.\n";
 
+// Laying out notifications is spread over at most this many threads, on top
+// of the main thread.
+#define MAX_LAYOUT_THREADS 3
+
+static size_t get_layout_thread_count(void) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus <= 1) {
+		return 0;
+	}
+	return cpus - 1 < MAX_LAYOUT_THREADS ? cpus - 1 : MAX_LAYOUT_THREADS;
+}
+
+// Signals handled through the event loop. They're blocked before any thread is
+// started, so that all threads inherit the mask and they're only ever read
+// from the signalfd.
+static sigset_t get_handled_signals(void) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
+	return mask;
+}
+
+static void dump_stats(struct mako_state *state) {
+	size_t bucket_count = wl_list_length(&state->rate_limiter.buckets);
+	size_t group_count = wl_list_length(&state->groups);
+	fprintf(stderr, "notifications: %zu (%zu bytes), groups: %zu, "
+		"last ID: %" PRIu32 "\n", state->notification_count,
+		state->notification_bytes, group_count,
+		(uint32_t)atomic_load(&state->last_id));
+	fprintf(stderr, "rate limiter: %zu buckets, %" PRIu64 " dropped, "
+		"%" PRIu64 " merged\n", bucket_count, state->rate_limiter.dropped,
+		state->rate_limiter.merged);
+}
+
+static int handle_signal(uint32_t events, void *data) {
+	struct mako_state *state = data;
+
+	struct signalfd_siginfo info;
+	while (read(state->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		switch (info.ssi_signo) {
+		case SIGINT:
+		case SIGTERM:
+			stop_event_loop(&state->event_loop);
+			break;
+		case SIGHUP:
+			reload(state, NULL);
+			break;
+		case SIGUSR1:
+			dump_stats(state);
+			break;
+		}
+	}
+	return 0;
+}
+
+static bool init_signals(struct mako_state *state) {
+	sigset_t mask = get_handled_signals();
+	state->signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (state->signal_fd < 0) {
+		fprintf(stderr, "failed to create signalfd: %s\n", strerror(errno));
+		return false;
+	}
+
+	if (add_event_loop_fd(&state->event_loop, state->signal_fd, EPOLLIN,
+			handle_signal, state) == NULL) {
+		close(state->signal_fd);
+		state->signal_fd = -1;
+		return false;
+	}
+	return true;
+}
+
 static bool init(struct mako_state *state) {
+	state->signal_fd = -1;
+
+	// D-Bus comes first: clients are waiting for the name to be owned, and
+	// once the D-Bus thread runs, their notifications are queued until the
+	// event loop starts, while Wayland is set up.
 	if (!init_dbus(state)) {
 		return false;
 	}
 	if (!init_wayland(state)) {
-		finish_dbus(state);
-		return false;
+		goto error_dbus;
+	}
+	if (!init_worker_pool(&state->layout_pool, get_layout_thread_count())) {
+		goto error_wayland;
+	}
+	if (!init_event_loop(&state->event_loop, state->display)) {
+		goto error_worker_pool;
+	}
+	if (add_event_loop_fd(&state->event_loop, state->dbus_thread.requests_fd,
+			EPOLLIN, dispatch_dbus_requests, state) == NULL ||
+			!init_config_reload(state)) {
+		goto error_event_loop;
+	}
+	if (!init_signals(state)) {
+		goto error_config_reload;
 	}
-	init_event_loop(&state->event_loop, state->bus, state->display);
 	wl_list_init(&state->notifications);
+	wl_list_init(&state->groups);
+	for (size_t i = 0; i < MAKO_DEDUP_INDEX_SIZE; ++i) {
+		wl_list_init(&state->dedup_index[i]);
+	}
+	init_rate_limiter(&state->rate_limiter);
+	mark_timing("event loop");
 	return true;
+
+error_config_reload:
+	finish_config_reload(state);
+error_event_loop:
+	finish_event_loop(&state->event_loop);
+error_worker_pool:
+	finish_worker_pool(&state->layout_pool);
+error_wayland:
+	finish_wayland(state);
+error_dbus:
+	finish_dbus(state);
+	return false;
 }
 
 static void finish(struct mako_state *state) {
@@ -55,19 +191,20 @@ static void finish(struct mako_state *state) {
 	wl_list_for_each_safe(notif, tmp, &state->notifications, link) {
 		destroy_notification(notif);
 	}
+	finish_rate_limiter(&state->rate_limiter);
+	finish_config_reload(state);
 	finish_event_loop(&state->event_loop);
+	if (state->signal_fd >= 0) {
+		close(state->signal_fd);
+	}
+	finish_worker_pool(&state->layout_pool);
 	finish_wayland(state);
 	finish_dbus(state);
 }
 
-static struct mako_event_loop *event_loop = NULL;
-
-static void handle_signal(int signum) {
-	stop_event_loop(event_loop);
-}
-
 int main(int argc, char *argv[]) {
 	struct mako_state state = {0};
+	start_timings();
 
 	state.argc = argc;
 	state.argv = argv;
@@ -75,6 +212,7 @@ int main(int argc, char *argv[]) {
 	// This is a bit wasteful, but easier than special-casing the reload.
 	init_default_config(&state.config);
 	int ret = reload_config(&state.config, argc, argv);
+	mark_timing("config");
 
 	if (ret < 0) {
 		return EXIT_FAILURE;
@@ -83,15 +221,20 @@ int main(int argc, char *argv[]) {
 		return EXIT_SUCCESS;
 	}
 
-	if (!init(&state)) {
+	sigset_t mask = get_handled_signals();
+	ret = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "failed to block signals: %s\n", strerror(ret));
 		finish_config(&state.config);
 		return EXIT_FAILURE;
 	}
 
-	event_loop = &state.event_loop;
-	struct sigaction sa = { .sa_handler = handle_signal };
-	sigaction(SIGINT, &sa, NULL);
-	sigaction(SIGTERM, &sa, NULL);
+	if (!init(&state)) {
+		finish_config(&state.config);
+		return EXIT_FAILURE;
+	}
+	end_timings(state.config.timings);
+	schedule_font_preload(&state);
 
 	ret = run_event_loop(&state.event_loop);
 
@@ -1,5 +1,6 @@
 #define _POSIX_C_SOURCE 200809L
 #include <ctype.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +13,7 @@
 #endif
 
 #include "config.h"
+#include "criteria.h"
 #include "dbus.h"
 #include "event-loop.h"
 #include "mako.h"
@@ -25,7 +27,188 @@ bool hotspot_at(struct mako_hotspot *hotspot, int32_t x, int32_t y) {
 }
 
 
-struct mako_notification *create_notification(struct mako_state *state) {
+static bool group_is_collapsed(const struct mako_group *group) {
+	return group != NULL && group->count > 1 && !group->expanded;
+}
+
+bool notification_is_grouped(const struct mako_notification *notif) {
+	return notif->group != NULL && notif->group->count > 1;
+}
+
+void reset_group_walk(struct mako_state *state) {
+	struct mako_group *group;
+	wl_list_for_each(group, &state->groups, link) {
+		group->seen = false;
+	}
+}
+
+// Whether the notification is left out when walking over the notifications,
+// because it's part of a collapsed group whose tile was already visited.
+// Groups must have been reset with reset_group_walk before the walk.
+bool notification_is_collapsed(struct mako_notification *notif) {
+	if (!group_is_collapsed(notif->group)) {
+		return false;
+	}
+	if (notif->group->seen) {
+		return true;
+	}
+	notif->group->seen = true;
+	return false;
+}
+
+// Counts the notifications which don't fit in the first max-visible tiles.
+size_t count_hidden_notifications(struct mako_state *state) {
+	int32_t max_visible = state->config.max_visible;
+	if (max_visible < 0) {
+		return 0;
+	}
+
+	reset_group_walk(state);
+	size_t total = 0, visible = 0, tiles = 0;
+	struct mako_notification *notif;
+	wl_list_for_each(notif, &state->notifications, link) {
+		++total;
+		if (notification_is_collapsed(notif)) {
+			continue;
+		}
+		if (tiles < (size_t)max_visible) {
+			visible += group_is_collapsed(notif->group) ?
+				notif->group->count : 1;
+		}
+		++tiles;
+	}
+	return total - visible;
+}
+
+static void restyle_notification(struct mako_notification *notif) {
+	finish_style(&notif->style);
+	init_empty_style(&notif->style);
+	apply_each_criteria(&notif->state->config, notif);
+	invalidate_notification(notif);
+}
+
+// Called when the size of the group changed, which changes the text of its
+// notifications. If it went between one and more notifications, whether they
+// match "grouped" criteria changed too, so their style is recomputed.
+static void update_group(struct mako_state *state, struct mako_group *group,
+		bool restyle) {
+	struct mako_notification *notif;
+	wl_list_for_each(notif, &state->notifications, link) {
+		if (notif->group != group) {
+			continue;
+		}
+		if (restyle) {
+			restyle_notification(notif);
+		} else {
+			invalidate_notification(notif);
+		}
+	}
+}
+
+static const char *get_group_key(const struct mako_notification *notif,
+		bool *by_app_name) {
+	if (notif->style.group != NULL && notif->style.group[0] != '\0') {
+		*by_app_name = false;
+		return notif->style.group;
+	}
+	if (notif->state->config.group_by == MAKO_GROUP_BY_APP_NAME) {
+		*by_app_name = true;
+		return notif->app_name;
+	}
+	return NULL;
+}
+
+static void join_group(struct mako_notification *notif) {
+	struct mako_state *state = notif->state;
+	bool by_app_name;
+	const char *key = get_group_key(notif, &by_app_name);
+	if (key == NULL) {
+		return;
+	}
+
+	struct mako_group *group, *found = NULL;
+	wl_list_for_each(group, &state->groups, link) {
+		if (group->by_app_name == by_app_name &&
+				strcmp(group->key, key) == 0) {
+			found = group;
+			break;
+		}
+	}
+
+	if (found == NULL) {
+		found = calloc(1, sizeof(struct mako_group));
+		if (found == NULL) {
+			fprintf(stderr, "allocation failed\n");
+			return;
+		}
+		found->key = strdup(key);
+		if (found->key == NULL) {
+			fprintf(stderr, "allocation failed\n");
+			free(found);
+			return;
+		}
+		found->by_app_name = by_app_name;
+		wl_list_insert(&state->groups, &found->link);
+	}
+
+	notif->group = found;
+	++found->count;
+	if (found->count == 2) {
+		update_group(state, found, true);
+	} else if (found->count > 2) {
+		update_group(state, found, false);
+		restyle_notification(notif);
+	}
+}
+
+// Removes the notification from its group, leaving the group to be updated
+// later by update_resized_groups.
+static void detach_from_group(struct mako_notification *notif) {
+	struct mako_group *group = notif->group;
+	if (group == NULL) {
+		return;
+	}
+	notif->group = NULL;
+
+	--group->count;
+	if (group->count == 0) {
+		wl_list_remove(&group->link);
+		free(group->key);
+		free(group);
+		return;
+	}
+	if (!group->resized) {
+		group->resized = true;
+		group->old_count = group->count + 1;
+	}
+}
+
+static void update_resized_groups(struct mako_state *state) {
+	struct mako_group *group;
+	wl_list_for_each(group, &state->groups, link) {
+		if (!group->resized) {
+			continue;
+		}
+		group->resized = false;
+		update_group(state, group,
+			(group->old_count > 1) != (group->count > 1));
+	}
+}
+
+static void leave_group(struct mako_notification *notif) {
+	if (notif->group != NULL) {
+		detach_from_group(notif);
+		update_resized_groups(notif->state);
+	}
+}
+
+// Can be called from any thread.
+uint32_t allocate_notification_id(struct mako_state *state) {
+	return atomic_fetch_add(&state->last_id, 1) + 1;
+}
+
+struct mako_notification *create_notification(struct mako_state *state,
+		uint32_t id) {
 	struct mako_notification *notif =
 		calloc(1, sizeof(struct mako_notification));
 	if (notif == NULL) {
@@ -34,15 +217,26 @@ struct mako_notification *create_notification(struct mako_state *state) {
 	}
 
 	notif->state = state;
-	++state->last_id;
-	notif->id = state->last_id;
+	notif->id = id;
+	wl_list_init(&notif->link);
+	wl_list_init(&notif->dedup_link);
 	wl_list_init(&notif->actions);
+	notif->count = 1;
 	notif->urgency = MAKO_NOTIFICATION_URGENCY_UNKNOWN;
 	return notif;
 }
 
 void destroy_notification(struct mako_notification *notif) {
+	struct mako_state *state = notif->state;
+	// Only notifications which were inserted are counted
+	if (!wl_list_empty(&notif->link)) {
+		--state->notification_count;
+	}
+	state->notification_bytes -= notif->size;
+	leave_group(notif);
+
 	wl_list_remove(&notif->link);
+	wl_list_remove(&notif->dedup_link);
 	struct mako_action *action, *tmp;
 	wl_list_for_each_safe(action, tmp, &notif->actions, link) {
 		wl_list_remove(&action->link);
@@ -58,197 +252,454 @@ void destroy_notification(struct mako_notification *notif) {
 	free(notif->body);
 	free(notif->category);
 	free(notif->desktop_entry);
+	free(notif->aliases);
+	finish_text_buffer(&notif->text);
+	finish_parsed_text(&notif->parsed);
+	if (notif->layout != NULL) {
+		g_object_unref(notif->layout);
+	}
 	free(notif);
 }
 
+// Drop everything that was computed from the notification's style, so that it
+// gets recomputed the next time it's needed. Must be called after the style
+// changes.
+void invalidate_notification(struct mako_notification *notif) {
+	notif->text_valid = false;
+	notif->layout_valid = false;
+}
+
 void close_notification(struct mako_notification *notif,
 		enum mako_notification_close_reason reason) {
-	notify_notification_closed(notif, reason);
-	destroy_notification(notif);
+	close_notifications(notif->state, &notif, 1, reason);
 }
 
-struct mako_notification *get_notification(struct mako_state *state,
-		uint32_t id) {
-	struct mako_notification *notif;
-	wl_list_for_each(notif, &state->notifications, link) {
-		if (notif->id == id) {
-			return notif;
+// Closes several notifications at once. Their timers are all destroyed in one
+// go, their signals are sent together, and the groups they were part of are
+// only updated once.
+void close_notifications(struct mako_state *state,
+		struct mako_notification **notifs, size_t count,
+		enum mako_notification_close_reason reason) {
+	struct mako_timer **timers = calloc(count, sizeof(struct mako_timer *));
+	if (timers != NULL) {
+		for (size_t i = 0; i < count; ++i) {
+			timers[i] = notifs[i]->timer;
+			notifs[i]->timer = NULL;
 		}
+		destroy_timers(timers, count);
+		free(timers);
 	}
-	return NULL;
-}
 
-void close_all_notifications(struct mako_state *state,
-		enum mako_notification_close_reason reason) {
-	struct mako_notification *notif, *tmp;
-	wl_list_for_each_safe(notif, tmp, &state->notifications, link) {
-		close_notification(notif, reason);
+	for (size_t i = 0; i < count; ++i) {
+		detach_from_group(notifs[i]);
 	}
-}
 
-static size_t trim_space(char *dst, const char *src) {
-	size_t src_len = strlen(src);
-	const char *start = src;
-	const char *end = src + src_len;
-
-	while (start != end && isspace(start[0])) {
-		++start;
-	}
+	notify_notifications_closed(state, notifs, count, reason);
 
-	while (end != start && isspace(end[-1])) {
-		--end;
+	for (size_t i = 0; i < count; ++i) {
+		destroy_notification(notifs[i]);
 	}
 
-	size_t trimmed_len = end - start;
-	memmove(dst, start, trimmed_len);
-	dst[trimmed_len] = '\0';
-	return trimmed_len;
+	update_resized_groups(state);
 }
 
-static const char *escape_markup_char(char c) {
-	switch (c) {
-	case '&': return "&amp;";
-	case '<': return "&lt;";
-	case '>': return "&gt;";
-	case '\'': return "&apos;";
-	case '"': return "&quot;";
+struct mako_notification *get_notification(struct mako_state *state,
+		uint32_t id) {
+	struct mako_notification *notif;
+	wl_list_for_each(notif, &state->notifications, link) {
+		if (notif->id == id) {
+			return notif;
+		}
+		for (size_t i = 0; i < notif->alias_count; ++i) {
+			if (notif->aliases[i] == id) {
+				return notif;
+			}
+		}
 	}
 	return NULL;
 }
 
-static size_t escape_markup(const char *s, char *buf) {
-	size_t len = 0;
-	while (s[0] != '\0') {
-		const char *replacement = escape_markup_char(s[0]);
-		if (replacement != NULL) {
-			size_t replacement_len = strlen(replacement);
-			if (buf != NULL) {
-				memcpy(buf + len, replacement, replacement_len);
-			}
-			len += replacement_len;
-		} else {
-			if (buf != NULL) {
-				buf[len] = s[0];
-			}
-			++len;
+// Makes `id`, which was given to the sender of a notification that ended up
+// stacked or merged into `notif`, refer to `notif`. Must be called once `notif`
+// is inserted.
+void add_notification_alias(struct mako_notification *notif, uint32_t id) {
+	if (notif->alias_count == notif->alias_capacity) {
+		size_t capacity = notif->alias_capacity ?
+			notif->alias_capacity * 2 : 4;
+		uint32_t *aliases = realloc(notif->aliases,
+			capacity * sizeof(uint32_t));
+		if (aliases == NULL) {
+			fprintf(stderr, "allocation failed\n");
+			return;
 		}
-		++s;
-	}
-	if (buf != NULL) {
-		buf[len] = '\0';
+		notif->aliases = aliases;
+		notif->alias_capacity = capacity;
 	}
-	return len;
-}
-
-static char *mako_asprintf(const char *fmt, ...) {
-	char *text;
-	va_list args;
+	notif->aliases[notif->alias_count++] = id;
 
-	va_start(args, fmt);
-	int size = vsnprintf(NULL, 0, fmt, args);
-	va_end(args);
+	notif->size += sizeof(uint32_t);
+	notif->state->notification_bytes += sizeof(uint32_t);
+}
 
-	if (size < 0) {
-		return NULL;
+void close_all_notifications(struct mako_state *state,
+		enum mako_notification_close_reason reason) {
+	size_t count = wl_list_length(&state->notifications);
+	if (count == 0) {
+		return;
 	}
 
-	text = malloc(size + 1);
-	if (text == NULL) {
-		return NULL;
+	struct mako_notification **notifs =
+		calloc(count, sizeof(struct mako_notification *));
+	if (notifs == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		struct mako_notification *notif, *tmp;
+		wl_list_for_each_safe(notif, tmp, &state->notifications, link) {
+			close_notification(notif, reason);
+		}
+		return;
 	}
 
-	va_start(args, fmt);
-	vsnprintf(text, size + 1, fmt, args);
-	va_end(args);
-
-	return text;
+	size_t i = 0;
+	struct mako_notification *notif;
+	wl_list_for_each(notif, &state->notifications, link) {
+		notifs[i++] = notif;
+	}
+	close_notifications(state, notifs, count, reason);
+	free(notifs);
 }
 
 // Any new format specifiers must also be added to VALID_FORMAT_SPECIFIERS.
 
-char *format_state_text(char variable, bool *markup, void *data) {
+const char *format_state_text(char variable, bool *markup, char *scratch,
+		void *data) {
 	struct mako_state *state = data;
 	switch (variable) {
 	case 'h':;
-		int hidden = wl_list_length(&state->notifications) - state->config.max_visible;
-		return mako_asprintf("%d", hidden);
+		size_t hidden = count_hidden_notifications(state);
+		snprintf(scratch, MAKO_FORMAT_SCRATCH_SIZE, "%zu", hidden);
+		return scratch;
 	case 't':;
 		int count = wl_list_length(&state->notifications);
-		return mako_asprintf("%d", count);
+		snprintf(scratch, MAKO_FORMAT_SCRATCH_SIZE, "%d", count);
+		return scratch;
 	}
 	return NULL;
 }
 
-char *format_notif_text(char variable, bool *markup, void *data) {
+const char *format_notif_text(char variable, bool *markup, char *scratch,
+		void *data) {
 	struct mako_notification *notif = data;
 	switch (variable) {
 	case 'a':
-		return strdup(notif->app_name);
+		return notif->app_name;
 	case 's':
-		return strdup(notif->summary);
+		return notif->summary;
 	case 'b':
 		*markup = notif->style.markup;
-		return strdup(notif->body);
+		return notif->body;
+	case 'c':
+		snprintf(scratch, MAKO_FORMAT_SCRATCH_SIZE, "%" PRIu32, notif->count);
+		return scratch;
+	case 'g':;
+		size_t group_count = notif->group != NULL ? notif->group->count : 1;
+		snprintf(scratch, MAKO_FORMAT_SCRATCH_SIZE, "%zu", group_count);
+		return scratch;
 	}
 	return NULL;
 }
 
-size_t format_text(const char *format, char *buf, mako_format_func_t format_func, void *data) {
-	size_t len = 0;
+// Run a compiled format, replacing the contents of `buf` with the result.
+// Returns false if an allocation fails.
+bool format_text(const struct mako_format_program *program,
+		struct mako_text_buffer *buf, mako_format_func_t format_func,
+		void *data) {
+	reset_text_buffer(buf);
+	if (!text_buffer_reserve(buf, 0)) {
+		return false;
+	}
 
-	const char *last = format;
-	while (1) {
-		char *current = strchr(last, '%');
-		if (current == NULL || current[1] == '\0') {
-			size_t tail_len = strlen(last);
-			if (buf != NULL) {
-				memcpy(buf + len, last, tail_len + 1);
-			}
-			len += tail_len;
-			break;
-		}
+	char scratch[MAKO_FORMAT_SCRATCH_SIZE];
+	for (size_t i = 0; i < program->op_count; ++i) {
+		const struct mako_format_op *op = &program->ops[i];
 
-		size_t chunk_len = current - last;
-		if (buf != NULL) {
-			memcpy(buf + len, last, chunk_len);
+		if (op->type == MAKO_FORMAT_OP_LITERAL) {
+			if (!text_buffer_append(buf, program->literals + op->offset,
+					op->len)) {
+				return false;
+			}
+			continue;
 		}
-		len += chunk_len;
 
-		char *value = NULL;
 		bool markup = false;
+		const char *value = format_func(op->specifier, &markup, scratch, data);
+		if (value == NULL) {
+			value = "";
+		}
 
-		if (current[1] == '%') {
-			value = strdup("%");
+		size_t value_len = strlen(value);
+		bool ok;
+		if (!markup || !pango_parse_markup(value, -1, 0, NULL, NULL, NULL, NULL)) {
+			ok = text_buffer_append_escaped(buf, value, value_len);
 		} else {
-			value =	format_func(current[1], &markup, data);
+			ok = text_buffer_append(buf, value, value_len);
 		}
-		if (value == NULL) {
-			value = strdup("");
+		if (!ok) {
+			return false;
+		}
+	}
+
+	text_buffer_trim(buf);
+	return true;
+}
+
+// Split `markup` into plain text and attributes. Invalid markup is reported
+// and kept as plain text, with the `fallback` flag set. Returns false if an
+// allocation fails.
+bool parse_text_markup(const char *markup, struct mako_parsed_text *out) {
+	struct mako_parsed_text parsed = {0};
+	GError *error = NULL;
+	if (!pango_parse_markup(markup, -1, 0, &parsed.attrs, &parsed.text, NULL,
+			&error)) {
+		fprintf(stderr, "cannot parse pango markup: %s\n", error->message);
+		g_error_free(error);
+		parsed.fallback = true;
+		parsed.attrs = NULL;
+		parsed.text = strdup(markup);
+		if (parsed.text == NULL) {
+			fprintf(stderr, "allocation failed\n");
+			return false;
 		}
+	}
 
-		size_t value_len;
-		if (!markup || !pango_parse_markup(value, -1, 0, NULL, NULL, NULL, NULL)) {
-			char *escaped = NULL;
-			if (buf != NULL) {
-				escaped = buf + len;
+	finish_parsed_text(out);
+	*out = parsed;
+	return true;
+}
+
+void finish_parsed_text(struct mako_parsed_text *parsed) {
+	if (parsed->attrs != NULL) {
+		pango_attr_list_unref(parsed->attrs);
+	}
+	if (parsed->fallback) {
+		free(parsed->text);
+	} else {
+		g_free(parsed->text);
+	}
+	memset(parsed, 0, sizeof(struct mako_parsed_text));
+}
+
+// Returns the formatted and parsed text of the notification, computing it
+// first if it isn't cached yet. Returns NULL on allocation failure.
+const struct mako_parsed_text *format_notification(
+		struct mako_notification *notif) {
+	if (!notif->text_valid) {
+		if (!format_text(&notif->style.format_program, &notif->text,
+				format_notif_text, notif) ||
+				!parse_text_markup(notif->text.data, &notif->parsed)) {
+			return NULL;
+		}
+		notif->text_valid = true;
+	}
+	return &notif->parsed;
+}
+
+// Estimate generously how much of a body can be seen in a notification with
+// the given style. The font size is used as a lower bound of the line height,
+// and a quarter of it as a lower bound of the glyph width. The result is then
+// doubled to make up for zero-width characters. Returns false if the font
+// size isn't known, in which case nothing is estimated.
+static bool estimate_visible_body(const struct mako_style *style,
+		size_t *max_chars, size_t *max_lines) {
+	PangoFontDescription *desc =
+		pango_font_description_from_string(style->font);
+	int font_size = pango_font_description_get_size(desc) / PANGO_SCALE;
+	pango_font_description_free(desc);
+	if (font_size <= 0) {
+		return false;
+	}
+
+	int box_width = style->width - 2 * (style->border_size + style->padding);
+	int box_height = style->height - 2 * (style->border_size + style->padding);
+	if (box_width <= 0 || box_height <= 0) {
+		return false;
+	}
+
+	size_t lines = box_height / font_size + 1;
+	size_t chars_per_line = 4 * box_width / font_size + 1;
+	*max_lines = lines;
+	*max_chars = 2 * lines * chars_per_line;
+	return true;
+}
+
+// Entities longer than this aren't looked for, and are counted as text.
+#define MAX_ENTITY_LEN 32
+
+static size_t tag_name_len(const char *name) {
+	return strcspn(name, " \t\n/>");
+}
+
+// Returns the length of the entity starting at `body`, including the '&' and
+// the ';', or 0 if there isn't one.
+static size_t entity_len(const char *body) {
+	for (size_t i = 1; i < MAX_ENTITY_LEN; ++i) {
+		char c = body[i];
+		if (c == ';') {
+			return i > 1 ? i + 1 : 0;
+		}
+		if (!isalnum((unsigned char)c) && c != '#') {
+			return 0;
+		}
+	}
+	return 0;
+}
+
+// Find where to cut `body` so that it has at most `max_chars` characters and
+// `max_lines` lines, zero meaning no limit. With `markup`, tags aren't counted
+// and entities count as one character; the tags still open at the cut are
+// pushed to `open_tags`, which has room for `open_capacity` of them, as
+// offsets of their name. A '<' or '&' which doesn't start a tag or an entity
+// is counted as text. Returns the length of the body if it fits.
+static size_t find_body_cut(const char *body, size_t max_chars,
+		size_t max_lines, bool markup, size_t *open_tags,
+		size_t open_capacity, size_t *open_count) {
+	size_t chars = 0, lines = 1;
+	*open_count = 0;
+
+	// Position of the first '>' after the last one looked for, so that the
+	// body is only scanned once for them. SIZE_MAX if there's none left.
+	size_t next_tag_end = 0;
+	bool tag_end_known = false;
+
+	size_t i = 0;
+	while (body[i] != '\0') {
+		char c = body[i];
+
+		if (markup && c == '<') {
+			if (!tag_end_known || (next_tag_end != SIZE_MAX &&
+					next_tag_end < i)) {
+				const char *end = strchr(body + i, '>');
+				next_tag_end = end != NULL ? (size_t)(end - body) : SIZE_MAX;
+				tag_end_known = true;
 			}
-			value_len = escape_markup(value, escaped);
-		} else {
-			value_len = strlen(value);
-			if (buf != NULL) {
-				memcpy(buf + len, value, value_len);
+			if (next_tag_end != SIZE_MAX) {
+				size_t tag_end = next_tag_end;
+				if (body[i + 1] == '/') {
+					if (*open_count > 0) {
+						--*open_count;
+					}
+				} else if (body[i + 1] != '!' && body[i + 1] != '?' &&
+						body[tag_end - 1] != '/' &&
+						tag_name_len(body + i + 1) > 0 &&
+						*open_count < open_capacity) {
+					open_tags[(*open_count)++] = i + 1;
+				}
+				i = tag_end + 1;
+				continue;
 			}
 		}
-		free(value);
 
-		len += value_len;
-		last = current + 2;
+		if (c == '\n') {
+			++lines;
+			if (max_lines > 0 && lines > max_lines) {
+				return i;
+			}
+		}
+
+		// Only count the first byte of UTF-8 sequences.
+		if ((c & 0xC0) != 0x80) {
+			++chars;
+			if (max_chars > 0 && chars > max_chars) {
+				return i;
+			}
+		}
+
+		if (markup && c == '&') {
+			size_t len = entity_len(body + i);
+			if (len > 0) {
+				i += len;
+				continue;
+			}
+		}
+
+		++i;
 	}
 
-	if (buf != NULL) {
-		trim_space(buf, buf);
+	return i;
+}
+
+// Truncate the body of the notification according to the limits of its style
+// and to what can possibly be visible, so that huge bodies don't have to be
+// kept around and laid out on every frame. Must be called once the style has
+// been applied. Returns false if an allocation fails.
+bool limit_notification_body(struct mako_notification *notif) {
+	struct mako_style *style = &notif->style;
+	size_t max_chars = style->max_body_length;
+	size_t max_lines = style->max_lines;
+
+	size_t visible_chars, visible_lines;
+	if (estimate_visible_body(style, &visible_chars, &visible_lines)) {
+		if (max_chars == 0 || visible_chars < max_chars) {
+			max_chars = visible_chars;
+		}
+		if (max_lines == 0 || visible_lines < max_lines) {
+			max_lines = visible_lines;
+		}
+	}
+	if (max_chars == 0 && max_lines == 0) {
+		return true;
 	}
-	return len;
+
+	// Only tags with a name are kept open, which takes at least three bytes,
+	// but find_body_cut checks the capacity anyway.
+	size_t body_len = strlen(notif->body);
+	size_t open_capacity = body_len / 2 + 1;
+	size_t *open_tags = calloc(open_capacity, sizeof(size_t));
+	if (open_tags == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+
+	size_t open_count = 0;
+	size_t cut = find_body_cut(notif->body, max_chars, max_lines,
+		style->markup, open_tags, open_capacity, &open_count);
+	if (cut == body_len) {
+		free(open_tags);
+		return true;
+	}
+
+	static const char ellipsis[] = "\u2026";
+	size_t truncated_len = cut + strlen(ellipsis);
+	for (size_t i = 0; i < open_count; ++i) {
+		truncated_len += tag_name_len(notif->body + open_tags[i]) + 3;
+	}
+
+	char *truncated = malloc(truncated_len + 1);
+	if (truncated == NULL) {
+		free(open_tags);
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+
+	char *pos = truncated;
+	memcpy(pos, notif->body, cut);
+	pos += cut;
+	memcpy(pos, ellipsis, strlen(ellipsis));
+	pos += strlen(ellipsis);
+	while (open_count > 0) {
+		const char *name = notif->body + open_tags[--open_count];
+		size_t name_len = tag_name_len(name);
+		*pos++ = '<';
+		*pos++ = '/';
+		memcpy(pos, name, name_len);
+		pos += name_len;
+		*pos++ = '>';
+	}
+	*pos = '\0';
+
+	free(open_tags);
+	free(notif->body);
+	notif->body = truncated;
+	return true;
 }
 
 static enum mako_button_binding get_button_binding(struct mako_config *config,
@@ -270,6 +721,12 @@ void notification_handle_button(struct mako_notification *notif, uint32_t button
 		return;
 	}
 
+	// Clicking a collapsed group shows all of its notifications.
+	if (group_is_collapsed(notif->group)) {
+		notif->group->expanded = true;
+		return;
+	}
+
 	switch (get_button_binding(&notif->state->config, button)) {
 	case MAKO_BUTTON_BINDING_NONE:
 		break;
@@ -320,6 +777,102 @@ static struct wl_list *get_last_notif_by_urgency(struct wl_list *notifications,
 	return notifications;
 }
 
+static size_t string_size(const char *s) {
+	return s != NULL ? strlen(s) + 1 : 0;
+}
+
+// Roughly how much memory the notification's own data uses, leaving out
+// caches which can be rebuilt.
+static size_t get_notification_size(const struct mako_notification *notif) {
+	size_t size = sizeof(struct mako_notification) +
+		string_size(notif->app_name) + string_size(notif->app_icon) +
+		string_size(notif->summary) + string_size(notif->body) +
+		string_size(notif->category) + string_size(notif->desktop_entry) +
+		notif->alias_count * sizeof(uint32_t);
+
+	struct mako_action *action;
+	wl_list_for_each(action, &notif->actions, link) {
+		size += sizeof(struct mako_action) + string_size(action->key) +
+			string_size(action->title);
+	}
+	return size;
+}
+
+static int eviction_urgency(const struct mako_notification *notif) {
+	if (notif->urgency == MAKO_NOTIFICATION_URGENCY_UNKNOWN) {
+		return MAKO_NOTIFICATION_URGENCY_NORMAL;
+	}
+	return notif->urgency;
+}
+
+// Picks the notification to close to make room, other than `keep`: the least
+// urgent, then oldest, of the hidden notifications if there are any, or of the
+// visible ones otherwise. Notifications in a collapsed group are hidden if the
+// group's tile is, like in render.
+static struct mako_notification *get_eviction_candidate(
+		struct mako_state *state, struct mako_notification *keep) {
+	int32_t max_visible = state->config.max_visible;
+	struct mako_notification *candidate = NULL;
+	bool candidate_hidden = false;
+
+	reset_group_walk(state);
+	int32_t tiles = 0;
+	struct mako_notification *notif;
+	wl_list_for_each(notif, &state->notifications, link) {
+		bool hidden;
+		if (notification_is_collapsed(notif)) {
+			hidden = notif->group->hidden;
+		} else {
+			hidden = max_visible >= 0 && tiles >= max_visible;
+			++tiles;
+			if (notif->group != NULL) {
+				notif->group->hidden = hidden;
+			}
+		}
+		if (notif == keep) {
+			continue;
+		}
+
+		if (candidate == NULL || (hidden && !candidate_hidden)) {
+			candidate = notif;
+			candidate_hidden = hidden;
+			continue;
+		} else if (hidden != candidate_hidden) {
+			continue;
+		}
+
+		int urgency = eviction_urgency(notif);
+		int candidate_urgency = eviction_urgency(candidate);
+		if (urgency < candidate_urgency || (urgency == candidate_urgency &&
+				notif->id < candidate->id)) {
+			candidate = notif;
+		}
+	}
+	return candidate;
+}
+
+static bool over_notification_limits(struct mako_state *state) {
+	struct mako_config *config = &state->config;
+	return (config->max_notifications > 0 &&
+			state->notification_count > (size_t)config->max_notifications) ||
+		(config->max_notifications_bytes > 0 &&
+			state->notification_bytes >
+			(size_t)config->max_notifications_bytes);
+}
+
+// Closes notifications until the limits on their number and memory usage are
+// met again, never closing `keep`.
+static void evict_notifications(struct mako_state *state,
+		struct mako_notification *keep) {
+	while (over_notification_limits(state)) {
+		struct mako_notification *victim = get_eviction_candidate(state, keep);
+		if (victim == NULL) {
+			break;
+		}
+		close_notification(victim, MAKO_NOTIFICATION_CLOSE_UNKNOWN);
+	}
+}
+
 void insert_notification(struct mako_state *state, struct mako_notification *notif) {
 	struct mako_config *config = &state->config;
 	struct wl_list *insert_node;
@@ -343,4 +896,119 @@ void insert_notification(struct mako_state *state, struct mako_notification *not
 	}
 
 	wl_list_insert(insert_node, &notif->link);
+	join_group(notif);
+
+	++state->notification_count;
+	notif->size = get_notification_size(notif);
+	state->notification_bytes += notif->size;
+	evict_notifications(state, notif);
+}
+
+// Applies the criteria of a new config to all of the notifications. They are
+// put back into groups, the group options having possibly changed, and their
+// bodies are truncated again. Bodies which were already truncated aren't
+// restored if the limits were relaxed.
+void restyle_notifications(struct mako_state *state) {
+	size_t count = wl_list_length(&state->notifications);
+	bool *expanded = calloc(count > 0 ? count : 1, sizeof(bool));
+	if (expanded == NULL) {
+		fprintf(stderr, "allocation failed\n");
+	}
+
+	// Every group ends up empty, so there's nothing to update
+	size_t i = 0;
+	struct mako_notification *notif;
+	wl_list_for_each(notif, &state->notifications, link) {
+		if (expanded != NULL && notif->group != NULL) {
+			expanded[i] = notif->group->expanded;
+		}
+		++i;
+		detach_from_group(notif);
+	}
+
+	wl_list_for_each(notif, &state->notifications, link) {
+		restyle_notification(notif);
+		if (!limit_notification_body(notif)) {
+			continue;
+		}
+		state->notification_bytes -= notif->size;
+		notif->size = get_notification_size(notif);
+		state->notification_bytes += notif->size;
+	}
+
+	// Same as for new notifications, the limits are applied before joining
+	i = 0;
+	wl_list_for_each(notif, &state->notifications, link) {
+		join_group(notif);
+		if (expanded != NULL && expanded[i] && notif->group != NULL) {
+			notif->group->expanded = true;
+		}
+		++i;
+	}
+	free(expanded);
+}
+
+static uint64_t hash_string(uint64_t hash, const char *s) {
+	// FNV-1a, including the NUL terminator so that fields can't run into
+	// each other
+	do {
+		hash ^= (unsigned char)*s;
+		hash *= 0x100000001b3;
+	} while (*s++ != '\0');
+	return hash;
+}
+
+uint64_t hash_notification_content(const char *app_name, const char *summary,
+		const char *body) {
+	uint64_t hash = 0xcbf29ce484222325;
+	hash = hash_string(hash, app_name);
+	hash = hash_string(hash, summary);
+	hash = hash_string(hash, body);
+	return hash;
+}
+
+// Adds the notification to the index used to find duplicates, `hash` being
+// the hash of its content as it was received.
+void index_notification(struct mako_notification *notif, uint64_t hash) {
+	struct mako_state *state = notif->state;
+	notif->content_hash = hash;
+	wl_list_remove(&notif->dedup_link);
+	wl_list_insert(&state->dedup_index[hash % MAKO_DEDUP_INDEX_SIZE],
+		&notif->dedup_link);
+}
+
+static bool same_actions(const struct mako_notification *a,
+		const struct mako_notification *b) {
+	struct wl_list *a_link = a->actions.next, *b_link = b->actions.next;
+	while (a_link != &a->actions && b_link != &b->actions) {
+		struct mako_action *a_action = wl_container_of(a_link, a_action, link);
+		struct mako_action *b_action = wl_container_of(b_link, b_action, link);
+		if (strcmp(a_action->key, b_action->key) != 0) {
+			return false;
+		}
+		a_link = a_link->next;
+		b_link = b_link->next;
+	}
+	return a_link == &a->actions && b_link == &b->actions;
+}
+
+// Finds a pending notification with the same content as `notif`, which isn't
+// inserted yet, `hash` being the hash of its content as it was received. Both
+// bodies must have been truncated, which hides differences past the cut, but
+// the hash covers those.
+struct mako_notification *find_duplicate_notification(struct mako_state *state,
+		uint64_t hash, const struct mako_notification *notif) {
+	struct mako_notification *other;
+	wl_list_for_each(other,
+			&state->dedup_index[hash % MAKO_DEDUP_INDEX_SIZE], dedup_link) {
+		if (other->content_hash == hash &&
+				other->urgency == notif->urgency &&
+				strcmp(other->app_name, notif->app_name) == 0 &&
+				strcmp(other->summary, notif->summary) == 0 &&
+				strcmp(other->body, notif->body) == 0 &&
+				same_actions(other, notif)) {
+			return other;
+		}
+	}
+	return NULL;
 }
@@ -0,0 +1,133 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "rate-limit.h"
+
+static void destroy_bucket(struct mako_rate_bucket *bucket) {
+	wl_list_remove(&bucket->link);
+	free(bucket->key);
+	free(bucket);
+}
+
+static double timespec_diff(const struct timespec *a,
+		const struct timespec *b) {
+	return (double)(a->tv_sec - b->tv_sec) +
+		(double)(a->tv_nsec - b->tv_nsec) / 1000000000.0;
+}
+
+static void refill_bucket(struct mako_rate_bucket *bucket,
+		const struct mako_config *config, const struct timespec *now) {
+	double elapsed = timespec_diff(now, &bucket->last_refill);
+	bucket->last_refill = *now;
+	if (elapsed > 0) {
+		bucket->tokens += elapsed * config->rate_limit;
+	}
+	if (bucket->tokens > config->rate_limit_burst) {
+		bucket->tokens = config->rate_limit_burst;
+	}
+}
+
+// Forgets the buckets which have refilled completely, so that the list only
+// holds the senders which are currently busy.
+static void prune_buckets(struct mako_rate_limiter *limiter,
+		const struct mako_config *config, const struct timespec *now) {
+	struct mako_rate_bucket *bucket, *tmp;
+	wl_list_for_each_safe(bucket, tmp, &limiter->buckets, link) {
+		refill_bucket(bucket, config, now);
+		if (bucket->tokens >= config->rate_limit_burst) {
+			destroy_bucket(bucket);
+		}
+	}
+}
+
+// Finds the bucket for `key`, creating a full one if there's none.
+static struct mako_rate_bucket *get_bucket(struct mako_rate_limiter *limiter,
+		const struct mako_config *config, enum mako_rate_bucket_type type,
+		const char *key, const struct timespec *now) {
+	struct mako_rate_bucket *bucket;
+	wl_list_for_each(bucket, &limiter->buckets, link) {
+		if (bucket->type == type && strcmp(bucket->key, key) == 0) {
+			return bucket;
+		}
+	}
+
+	bucket = calloc(1, sizeof(struct mako_rate_bucket));
+	if (bucket == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return NULL;
+	}
+	bucket->key = strdup(key);
+	if (bucket->key == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		free(bucket);
+		return NULL;
+	}
+	bucket->type = type;
+	bucket->tokens = config->rate_limit_burst;
+	bucket->last_refill = *now;
+	wl_list_insert(&limiter->buckets, &bucket->link);
+	return bucket;
+}
+
+void init_rate_limiter(struct mako_rate_limiter *limiter) {
+	memset(limiter, 0, sizeof(struct mako_rate_limiter));
+	wl_list_init(&limiter->buckets);
+}
+
+void finish_rate_limiter(struct mako_rate_limiter *limiter) {
+	struct mako_rate_bucket *bucket, *tmp;
+	wl_list_for_each_safe(bucket, tmp, &limiter->buckets, link) {
+		destroy_bucket(bucket);
+	}
+}
+
+// Takes a token from the buckets of both `sender` and `app_name`. Returns NULL
+// if the notification is allowed, or the bucket which ran out otherwise, in
+// which case no token is taken. Either key may be NULL or empty, in which case
+// its bucket is skipped.
+struct mako_rate_bucket *take_rate_limit_token(
+		struct mako_rate_limiter *limiter, const struct mako_config *config,
+		const char *sender, const char *app_name) {
+	if (config->rate_limit <= 0) {
+		return NULL;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	prune_buckets(limiter, config, &now);
+
+	struct mako_rate_bucket *buckets[2];
+	size_t bucket_count = 0;
+	if (app_name != NULL && app_name[0] != '\0') {
+		buckets[bucket_count++] = get_bucket(limiter, config,
+			MAKO_RATE_BUCKET_APP_NAME, app_name, &now);
+	}
+	if (sender != NULL && sender[0] != '\0') {
+		buckets[bucket_count++] = get_bucket(limiter, config,
+			MAKO_RATE_BUCKET_SENDER, sender, &now);
+	}
+
+	for (size_t i = 0; i < bucket_count; ++i) {
+		// If we can't keep track of a sender, let it through.
+		if (buckets[i] != NULL && buckets[i]->tokens < 1) {
+			++buckets[i]->throttled;
+			return buckets[i];
+		}
+	}
+
+	for (size_t i = 0; i < bucket_count; ++i) {
+		if (buckets[i] != NULL) {
+			buckets[i]->tokens -= 1;
+			// A bucket which isn't empty anymore ends the current flood, the
+			// next one gets a new merged notification.
+			if (buckets[i]->tokens >= 1) {
+				buckets[i]->merged_id = 0;
+				buckets[i]->merged_count = 0;
+			}
+		}
+	}
+	return NULL;
+}
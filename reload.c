@@ -0,0 +1,324 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "criteria.h"
+#include "dbus.h"
+#include "event-loop.h"
+#include "mako.h"
+#include "notification.h"
+#include "reload.h"
+#include "render.h"
+#include "wayland.h"
+
+static void *run_reload_thread(void *data) {
+	struct mako_state *state = data;
+	struct mako_config_reload *reload = &state->config_reload;
+
+	reload->ret = load_config(&reload->config, state->argc, state->argv);
+
+	uint64_t value = 1;
+	if (write(reload->fd, &value, sizeof(value)) < 0) {
+		fprintf(stderr, "failed to write to eventfd: %s\n", strerror(errno));
+	}
+	return NULL;
+}
+
+static void start_reload_thread(struct mako_state *state) {
+	struct mako_config_reload *reload = &state->config_reload;
+
+	wl_list_insert_list(&reload->waiters, &reload->queued);
+	wl_list_init(&reload->queued);
+	reload->again = false;
+
+	reload->running = true;
+	int ret = pthread_create(&reload->thread, NULL, run_reload_thread, state);
+	reload->threaded = ret == 0;
+	if (!reload->threaded) {
+		// Fall back to parsing right here
+		fprintf(stderr, "Failed to start reload thread: %s\n", strerror(ret));
+		run_reload_thread(state);
+	}
+}
+
+static void notify_reload_waiters(struct mako_state *state, bool ok) {
+	struct mako_config_reload *reload = &state->config_reload;
+	struct mako_reload_waiter *waiter, *tmp;
+	wl_list_for_each_safe(waiter, tmp, &reload->waiters, link) {
+		wl_list_remove(&waiter->link);
+		waiter->func(state, waiter, ok);
+	}
+}
+
+static void join_reload_thread(struct mako_config_reload *reload) {
+	if (reload->threaded) {
+		pthread_join(reload->thread, NULL);
+	}
+	reload->running = false;
+}
+
+// Changes to the config are only acted upon after this long without any other
+// change, since saving a file often takes several writes or renames.
+#define CONFIG_WATCH_DELAY_MS 200
+
+static const uint32_t file_watch_mask =
+	IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+static const uint32_t dir_watch_mask =
+	IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+static void remove_config_watches(struct mako_config_watch *watch) {
+	if (watch->file_wd >= 0) {
+		inotify_rm_watch(watch->fd, watch->file_wd);
+		watch->file_wd = -1;
+	}
+	if (watch->dir_wd >= 0) {
+		inotify_rm_watch(watch->fd, watch->dir_wd);
+		watch->dir_wd = -1;
+	}
+	free(watch->path);
+	watch->path = NULL;
+	watch->name = NULL;
+}
+
+// Watches the config file currently in use. The path is resolved again each
+// time the config is reloaded.
+static void update_config_watches(struct mako_config_watch *watch) {
+	if (watch->fd < 0) {
+		return;
+	}
+	remove_config_watches(watch);
+
+	watch->path = get_config_path();
+	if (watch->path == NULL) {
+		return;
+	}
+
+	char *slash = strrchr(watch->path, '/');
+	if (slash == NULL) {
+		return;
+	}
+	watch->name = slash + 1;
+
+	// The file itself is watched too in case it's a symlink, whose target is
+	// followed.
+	watch->file_wd = inotify_add_watch(watch->fd, watch->path,
+		file_watch_mask);
+	if (watch->file_wd < 0) {
+		fprintf(stderr, "Failed to watch %s: %s\n", watch->path,
+			strerror(errno));
+	}
+
+	*slash = '\0';
+	watch->dir_wd = inotify_add_watch(watch->fd,
+		slash == watch->path ? "/" : watch->path, dir_watch_mask);
+	if (watch->dir_wd < 0) {
+		fprintf(stderr, "Failed to watch %s: %s\n", watch->path,
+			strerror(errno));
+	}
+	*slash = '/';
+}
+
+// Called by the event loop once the thread is done.
+static int handle_reload_done(uint32_t events, void *data) {
+	struct mako_state *state = data;
+	struct mako_config_reload *reload = &state->config_reload;
+
+	uint64_t value;
+	if (read(reload->fd, &value, sizeof(value)) < 0) {
+		if (errno != EAGAIN) {
+			fprintf(stderr, "failed to read from eventfd: %s\n",
+				strerror(errno));
+		}
+		return 0;
+	}
+	if (!reload->running) {
+		return 0;
+	}
+	join_reload_thread(reload);
+
+	bool ok = reload->ret == 0;
+	if (ok) {
+		swap_config(&state->config, &reload->config);
+		update_dbus_capabilities(state);
+
+		restyle_notifications(state);
+
+		send_frame(state);
+		schedule_font_preload(state);
+	} else {
+		fprintf(stderr, "Keeping the current config\n");
+	}
+
+	// The file may have been replaced, or another one may now take precedence.
+	update_config_watches(&reload->watch);
+
+	notify_reload_waiters(state, ok);
+
+	if (reload->again) {
+		start_reload_thread(state);
+	}
+	return 0;
+}
+
+// Reloads the config in the background. `waiter`, which may be NULL, is told
+// whether it worked once the new config is in use.
+void reload(struct mako_state *state, struct mako_reload_waiter *waiter) {
+	struct mako_config_reload *reload = &state->config_reload;
+
+	if (waiter != NULL) {
+		wl_list_insert(reload->queued.prev, &waiter->link);
+	}
+
+	if (reload->running) {
+		reload->again = true;
+		return;
+	}
+	start_reload_thread(state);
+}
+
+static void handle_config_watch_timer(void *data) {
+	struct mako_state *state = data;
+	struct mako_config_watch *watch = &state->config_reload.watch;
+	watch->timer = NULL;
+
+	reload(state, NULL);
+}
+
+static int handle_config_watch(uint32_t events, void *data) {
+	struct mako_state *state = data;
+	struct mako_config_watch *watch = &state->config_reload.watch;
+
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	while (1) {
+		ssize_t n = read(watch->fd, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno != EAGAIN) {
+				fprintf(stderr, "failed to read from inotify FD: %s\n",
+					strerror(errno));
+			}
+			break;
+		}
+
+		for (char *ptr = buf; ptr < buf + n; ) {
+			const struct inotify_event *event =
+				(const struct inotify_event *)ptr;
+			ptr += sizeof(struct inotify_event) + event->len;
+
+			if (watch->path == NULL) {
+				continue;
+			}
+			if (event->wd == watch->file_wd && watch->file_wd >= 0) {
+				changed = true;
+			} else if (event->wd == watch->dir_wd && watch->dir_wd >= 0 &&
+					event->len > 0 && strcmp(event->name, watch->name) == 0) {
+				changed = true;
+			}
+		}
+	}
+
+	if (changed) {
+		destroy_timer(watch->timer);
+		watch->timer = add_event_loop_timer(&state->event_loop,
+			CONFIG_WATCH_DELAY_MS, handle_config_watch_timer, state);
+	}
+	return 0;
+}
+
+// Failing to watch the config isn't fatal, it just has to be reloaded by hand.
+static void init_config_watch(struct mako_state *state) {
+	struct mako_config_watch *watch = &state->config_reload.watch;
+	watch->path = NULL;
+	watch->name = NULL;
+	watch->file_wd = watch->dir_wd = -1;
+	watch->timer = NULL;
+	watch->source = NULL;
+
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fd < 0) {
+		fprintf(stderr, "Failed to watch the config: %s\n", strerror(errno));
+		return;
+	}
+
+	watch->source = add_event_loop_fd(&state->event_loop, watch->fd, EPOLLIN,
+		handle_config_watch, state);
+	if (watch->source == NULL) {
+		close(watch->fd);
+		watch->fd = -1;
+		return;
+	}
+
+	update_config_watches(watch);
+}
+
+static void finish_config_watch(struct mako_config_watch *watch) {
+	destroy_timer(watch->timer);
+	watch->timer = NULL;
+	remove_event_loop_fd(watch->source);
+	watch->source = NULL;
+	if (watch->fd >= 0) {
+		remove_config_watches(watch);
+		close(watch->fd);
+		watch->fd = -1;
+	}
+}
+
+bool init_config_reload(struct mako_state *state) {
+	struct mako_config_reload *reload = &state->config_reload;
+	reload->running = false;
+	reload->again = false;
+	wl_list_init(&reload->waiters);
+	wl_list_init(&reload->queued);
+
+	reload->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (reload->fd < 0) {
+		fprintf(stderr, "failed to create eventfd: %s\n", strerror(errno));
+		return false;
+	}
+
+	reload->source = add_event_loop_fd(&state->event_loop, reload->fd,
+		EPOLLIN, handle_reload_done, state);
+	if (reload->source == NULL) {
+		close(reload->fd);
+		reload->fd = -1;
+		return false;
+	}
+
+	init_config_watch(state);
+	return true;
+}
+
+// A parse still running is waited for, and thrown away. Waiters are told it
+// failed.
+void finish_config_reload(struct mako_state *state) {
+	struct mako_config_reload *reload = &state->config_reload;
+	finish_config_watch(&reload->watch);
+
+	if (reload->running) {
+		join_reload_thread(reload);
+		if (reload->ret == 0) {
+			finish_config(&reload->config);
+		}
+	}
+
+	notify_reload_waiters(state, false);
+	wl_list_insert_list(&reload->waiters, &reload->queued);
+	wl_list_init(&reload->queued);
+	notify_reload_waiters(state, false);
+
+	remove_event_loop_fd(reload->source);
+	reload->source = NULL;
+	if (reload->fd >= 0) {
+		close(reload->fd);
+		reload->fd = -1;
+	}
+}
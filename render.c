@@ -1,5 +1,7 @@
 #define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <cairo/cairo.h>
 #include <pango/pangocairo.h>
 #include <assert.h>
@@ -12,6 +14,10 @@
 #include "wayland.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 
+// Number of hidden notifications laid out ahead of time, to be ready once they
+// are shown.
+#define PRELAYOUT_COUNT 3
+
 // HiDPI conventions: local variables are in surface-local coordinates, unless
 // they have a "buffer_" prefix, in which case they are in buffer-local
 // coordinates.
@@ -57,42 +63,43 @@ static cairo_subpixel_order_t get_cairo_subpixel_order(
 	assert(0);
 }
 
-static void set_font_options(cairo_t *cairo, struct mako_state *state) {
-	if (state->surface_output == NULL) {
+// Everything needed to lay out the text of a notification, so that it can be
+// done on a worker thread.
+struct layout_job {
+	struct mako_notification *notif;
+	int width, height; // Of the text box
+	int scale;
+	int subpixel; // enum wl_output_subpixel, or -1 if there's no output
+	bool ok;
+};
+
+static void set_font_options(PangoContext *context, int subpixel) {
+	if (subpixel < 0) {
 		return;
 	}
 
 	cairo_font_options_t *fo = cairo_font_options_create();
 	cairo_font_options_set_antialias(fo, CAIRO_ANTIALIAS_SUBPIXEL);
 	cairo_font_options_set_subpixel_order(fo,
-		get_cairo_subpixel_order(state->surface_output->subpixel));
-	cairo_set_font_options(cairo, fo);
+		get_cairo_subpixel_order(subpixel));
+	pango_cairo_context_set_font_options(context, fo);
 	cairo_font_options_destroy(fo);
 }
 
-static int render_notification(cairo_t *cairo, struct mako_state *state,
-		struct mako_style *style, const char *text, int offset_y, int scale) {
-	int border_size = 2 * style->border_size;
-	int padding_size = 2 * style->padding;
-
-	// If the compositor has forced us to shrink down, do so.
-	int notif_width =
-		(style->width <= state->width) ? style->width : state->width;
-
-	int offset_x;
-	if (state->config.anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT) {
-		offset_x = state->width - notif_width - style->margin.right;
-	} else {
-		offset_x = style->margin.left;
-	}
-
-	set_font_options(cairo, state);
-
-	PangoLayout *layout = pango_cairo_create_layout(cairo);
-	set_layout_size(layout,
-		notif_width - border_size - padding_size,
-		style->height - border_size - padding_size,
-		scale);
+// Layouts are created from the calling thread's default font map rather than
+// from the buffer's cairo context, so that any thread can create them. They
+// are drawn with an identity transformation, so they don't need to be updated
+// for the cairo context afterwards.
+static PangoLayout *create_text_layout(const struct mako_style *style,
+		const struct mako_parsed_text *text, int width, int height,
+		int scale, int subpixel) {
+	PangoContext *context =
+		pango_font_map_create_context(pango_cairo_font_map_get_default());
+	set_font_options(context, subpixel);
+	PangoLayout *layout = pango_layout_new(context);
+	g_object_unref(context);
+
+	set_layout_size(layout, width, height, scale);
 	pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
 	pango_layout_set_ellipsize(layout, PANGO_ELLIPSIZE_END);
 	PangoFontDescription *desc =
@@ -100,29 +107,99 @@ static int render_notification(cairo_t *cairo, struct mako_state *state,
 	pango_layout_set_font_description(layout, desc);
 	pango_font_description_free(desc);
 
-	PangoAttrList *attrs = NULL;
-	GError *error = NULL;
-	char *buf = NULL;
-	if (pango_parse_markup(text, -1, 0, &attrs, &buf, NULL, &error)) {
-		pango_layout_set_text(layout, buf, -1);
-		free(buf);
-	} else {
-		fprintf(stderr, "cannot parse pango markup: %s\n", error->message);
-		g_error_free(error);
-		// fallback to plain text
-		pango_layout_set_text(layout, text, -1);
-	}
+	pango_layout_set_text(layout, text->text, -1);
 
-	if (attrs == NULL) {
+	// The scale attribute depends on the output, so it goes on a copy of the
+	// parsed attributes.
+	PangoAttrList *attrs;
+	if (text->attrs != NULL) {
+		attrs = pango_attr_list_copy(text->attrs);
+	} else {
 		attrs = pango_attr_list_new();
 	}
 	pango_attr_list_insert(attrs, pango_attr_scale_new(scale));
 	pango_layout_set_attributes(layout, attrs);
 	pango_attr_list_unref(attrs);
 
+	return layout;
+}
+
+static int get_layout_height(PangoLayout *layout, int scale) {
 	int buffer_text_height = 0;
 	pango_layout_get_pixel_size(layout, NULL, &buffer_text_height);
-	int text_height = buffer_text_height / scale;
+	return buffer_text_height / scale;
+}
+
+static int get_notif_width(struct mako_state *state,
+		const struct mako_style *style) {
+	// If the compositor has forced us to shrink down, do so.
+	return (style->width <= state->width) ? style->width : state->width;
+}
+
+static void init_layout_job(struct layout_job *job, struct mako_state *state,
+		struct mako_notification *notif, int scale) {
+	const struct mako_style *style = &notif->style;
+	int border_size = 2 * style->border_size;
+	int padding_size = 2 * style->padding;
+
+	job->notif = notif;
+	job->width = get_notif_width(state, style) - border_size - padding_size;
+	job->height = style->height - border_size - padding_size;
+	job->scale = scale;
+	job->subpixel = state->surface_output != NULL ?
+		(int)state->surface_output->subpixel : -1;
+	job->ok = false;
+}
+
+static bool layout_job_is_cached(const struct layout_job *job) {
+	const struct mako_notification *notif = job->notif;
+	return notif->layout_valid && notif->layout != NULL &&
+		notif->layout_width == job->width &&
+		notif->layout_height == job->height &&
+		notif->layout_scale == job->scale &&
+		notif->layout_subpixel == job->subpixel;
+}
+
+// Formats the notification, parses its markup and shapes its text. This only
+// touches the notification itself, so jobs can run in parallel.
+static void run_layout_job(void *data) {
+	struct layout_job *job = data;
+	struct mako_notification *notif = job->notif;
+
+	const struct mako_parsed_text *text = format_notification(notif);
+	if (text == NULL) {
+		return;
+	}
+
+	PangoLayout *layout = create_text_layout(&notif->style, text, job->width,
+		job->height, job->scale, job->subpixel);
+	if (notif->layout != NULL) {
+		g_object_unref(notif->layout);
+	}
+	notif->layout = layout;
+	notif->layout_text_height = get_layout_height(layout, job->scale);
+	notif->layout_width = job->width;
+	notif->layout_height = job->height;
+	notif->layout_scale = job->scale;
+	notif->layout_subpixel = job->subpixel;
+	notif->layout_valid = true;
+	job->ok = true;
+}
+
+static int render_notification(cairo_t *cairo, struct mako_state *state,
+		struct mako_style *style, PangoLayout *layout, int text_height,
+		int offset_y, int scale) {
+	int border_size = 2 * style->border_size;
+	int padding_size = 2 * style->padding;
+
+	int notif_width = get_notif_width(state, style);
+
+	int offset_x;
+	if (state->config.anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT) {
+		offset_x = state->width - notif_width - style->margin.right;
+	} else {
+		offset_x = style->margin.left;
+	}
 
 	int notif_height = border_size + padding_size + text_height;
 
@@ -155,12 +232,115 @@ static int render_notification(cairo_t *cairo, struct mako_state *state,
 		offset_x + style->border_size + style->padding,
 		offset_y + style->border_size + style->padding,
 		scale);
-	pango_cairo_update_layout(cairo, layout);
 	pango_cairo_show_layout(cairo, layout);
 
+	return notif_height;
+}
+
+// Renders the placeholder for hidden notifications below `total_height`, and
+// returns the new total height, or -1 on error.
+static int render_hidden(cairo_t *cairo, struct mako_state *state,
+		int total_height, int pending_bottom_margin, int scale) {
+	struct mako_config *config = &state->config;
+
+	// Apply the hidden_style on top of the global style. This has to be
+	// done here since this notification isn't "real" and wasn't processed
+	// by apply_each_criteria.
+	struct mako_style style;
+	init_empty_style(&style);
+	apply_style(&style, &global_criteria(config)->style);
+	apply_style(&style, &config->hidden_style);
+
+	if (style.margin.top > pending_bottom_margin) {
+		total_height += style.margin.top;
+	} else {
+		total_height += pending_bottom_margin;
+	}
+
+	struct mako_text_buffer text;
+	init_text_buffer(&text);
+	struct mako_parsed_text parsed = {0};
+	if (!format_text(&style.format_program, &text, format_state_text,
+			state) || !parse_text_markup(text.data, &parsed)) {
+		finish_text_buffer(&text);
+		finish_style(&style);
+		return -1;
+	}
+
+	int border_size = 2 * style.border_size;
+	int padding_size = 2 * style.padding;
+	int subpixel = state->surface_output != NULL ?
+		(int)state->surface_output->subpixel : -1;
+	PangoLayout *layout = create_text_layout(&style, &parsed,
+		get_notif_width(state, &style) - border_size - padding_size,
+		style.height - border_size - padding_size, scale, subpixel);
+	int hidden_height = render_notification(cairo, state, &style, layout,
+		get_layout_height(layout, scale), total_height, scale);
+
 	g_object_unref(layout);
+	finish_parsed_text(&parsed);
+	finish_text_buffer(&text);
+	finish_style(&style);
+	return total_height + hidden_height;
+}
 
-	return notif_height;
+// Lays out the first few hidden notifications, the way the next frame would if
+// they were visible, so that dismissing a visible notification doesn't have to
+// wait for the next one to be shaped.
+static void prelayout_hidden_notifications(struct mako_state *state) {
+	struct mako_config *config = &state->config;
+	if (config->max_visible < 0) {
+		return;
+	}
+
+	// Same as send_frame
+	int scale = 1;
+	if (state->surface_output != NULL) {
+		scale = state->surface_output->scale;
+	}
+
+	struct layout_job jobs[PRELAYOUT_COUNT];
+	void *pending[PRELAYOUT_COUNT];
+	size_t hidden_count = 0, pending_count = 0;
+
+	reset_group_walk(state);
+	size_t visible_count = 0;
+	struct mako_notification *notif;
+	wl_list_for_each(notif, &state->notifications, link) {
+		if (notification_is_collapsed(notif)) {
+			continue;
+		}
+		if (visible_count < (size_t)config->max_visible) {
+			++visible_count;
+			continue;
+		}
+
+		struct layout_job *job = &jobs[hidden_count++];
+		init_layout_job(job, state, notif, scale);
+		if (!layout_job_is_cached(job)) {
+			pending[pending_count++] = job;
+		}
+		if (hidden_count == PRELAYOUT_COUNT) {
+			break;
+		}
+	}
+
+	run_worker_pool(&state->layout_pool, run_layout_job, pending,
+		pending_count);
+}
+
+static void handle_prelayout(void *data) {
+	struct mako_state *state = data;
+	state->prelayout = NULL;
+	prelayout_hidden_notifications(state);
+}
+
+static void schedule_prelayout(struct mako_state *state) {
+	if (state->prelayout != NULL) {
+		return;
+	}
+	state->prelayout = add_event_loop_idle(&state->event_loop,
+		handle_prelayout, state);
 }
 
 int render(struct mako_state *state, struct pool_buffer *buffer, int scale) {
@@ -171,6 +351,44 @@ int render(struct mako_state *state, struct pool_buffer *buffer, int scale) {
 		return 0;
 	}
 
+	size_t count = wl_list_length(&state->notifications);
+	struct layout_job *jobs = calloc(count, sizeof(struct layout_job));
+	void **pending = calloc(count, sizeof(void *));
+	if (jobs == NULL || pending == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		free(jobs);
+		free(pending);
+		return 0;
+	}
+
+	// Find out which notifications are shown. Collapsed groups are only laid
+	// out once, as the tile of their first notification.
+	reset_group_walk(state);
+
+	size_t visible_count = 0, pending_count = 0;
+	struct mako_notification *notif;
+	wl_list_for_each(notif, &state->notifications, link) {
+		if (notification_is_collapsed(notif) || (config->max_visible >= 0 &&
+				visible_count >= (size_t)config->max_visible)) {
+			memset(&notif->hotspot, 0, sizeof(struct mako_hotspot));
+			continue;
+		}
+
+		struct layout_job *job = &jobs[visible_count++];
+		init_layout_job(job, state, notif, scale);
+		if (layout_job_is_cached(job)) {
+			job->ok = true;
+		} else {
+			pending[pending_count++] = job;
+		}
+	}
+
+	// Lay out the notifications which changed in parallel, then draw them all
+	// on this thread.
+	run_worker_pool(&state->layout_pool, run_layout_job, pending,
+		pending_count);
+	free(pending);
+
 	// Clear
 	cairo_save(cairo);
 	cairo_set_source_rgba(cairo, 0, 0, 0, 0);
@@ -178,34 +396,28 @@ int render(struct mako_state *state, struct pool_buffer *buffer, int scale) {
 	cairo_paint(cairo);
 	cairo_restore(cairo);
 
-	size_t i = 0;
 	int total_height = 0;
 	int pending_bottom_margin = 0;
-	struct mako_notification *notif;
-	wl_list_for_each(notif, &state->notifications, link) {
+	for (size_t i = 0; i < visible_count; ++i) {
+		struct layout_job *job = &jobs[i];
+		if (!job->ok) {
+			break;
+		}
+		notif = job->notif;
+
 		// Note that by this point, everything in the style is guaranteed to
 		// be specified, so we don't need to check.
 		struct mako_style *style = &notif->style;
 
-		size_t text_len =
-			format_text(style->format, NULL, format_notif_text, notif);
-		char *text = malloc(text_len + 1);
-		if (text == NULL) {
-			break;
-		}
-		format_text(style->format, text, format_notif_text, notif);
-
 		if (style->margin.top > pending_bottom_margin) {
 			total_height += style->margin.top;
 		} else {
 			total_height += pending_bottom_margin;
 		}
 
-		int notif_width =
-			(style->width <= state->width) ? style->width : state->width;
-		int notif_height = render_notification(
-				cairo, state, style, text, total_height, scale);
-		free(text);
+		int notif_width = get_notif_width(state, style);
+		int notif_height = render_notification(cairo, state, style,
+			notif->layout, notif->layout_text_height, total_height, scale);
 
 		// Update hotspot
 		notif->hotspot.x = 0;
@@ -215,45 +427,127 @@ int render(struct mako_state *state, struct pool_buffer *buffer, int scale) {
 
 		total_height += notif_height;
 		pending_bottom_margin = style->margin.bottom;
+	}
+	free(jobs);
 
-		++i;
-		if (config->max_visible >= 0 &&
-				i >= (size_t)config->max_visible) {
-			break;
+	if (count_hidden_notifications(state) > 0) {
+		schedule_prelayout(state);
+		total_height = render_hidden(cairo, state, total_height,
+			pending_bottom_margin, scale);
+		if (total_height < 0) {
+			return 0;
 		}
 	}
 
-	if (wl_list_length(&state->notifications) > config->max_visible) {
-		// Apply the hidden_style on top of the global style. This has to be
-		// done here since this notification isn't "real" and wasn't processed
-		// by apply_each_criteria.
+	return total_height;
+}
+
+// Text made of the characters most notifications use, in the weights of the
+// default format, so that their glyphs are rendered ahead of time.
+static const char preload_markup[] =
+	"<b>The quick brown fox jumps over the lazy dog</b>\n"
+	"THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG 0123456789 "
+	".,:;!?'\"()[]{}&lt;&gt;&amp;%/\\-+=*#@_";
+
+struct font_preload {
+	char **fonts; // Owned by the config
+	size_t font_count;
+	struct mako_parsed_text text;
+	int width, height, scale, subpixel;
+};
+
+// Pango font maps are per thread, so this runs on each thread which lays out
+// notifications. Glyphs are cached by cairo for all of them.
+static void preload_thread_fonts(void *data) {
+	struct font_preload *preload = data;
+
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+		preload->width * preload->scale, preload->height * preload->scale);
+	cairo_t *cairo = cairo_create(surface);
+	for (size_t i = 0; i < preload->font_count; ++i) {
 		struct mako_style style;
 		init_empty_style(&style);
-		apply_style(&style, &global_criteria(config)->style);
-		apply_style(&style, &config->hidden_style);
+		style.font = preload->fonts[i];
+
+		PangoLayout *layout = create_text_layout(&style, &preload->text,
+			preload->width, preload->height, preload->scale,
+			preload->subpixel);
+		cairo_move_to(cairo, 0, 0);
+		pango_cairo_show_layout(cairo, layout);
+		g_object_unref(layout);
+	}
+	cairo_destroy(cairo);
+	cairo_surface_destroy(surface);
+}
 
-		if (style.margin.top > pending_bottom_margin) {
-			total_height += style.margin.top;
-		} else {
-			total_height += pending_bottom_margin;
+static bool has_font(struct font_preload *preload, const char *font) {
+	for (size_t i = 0; i < preload->font_count; ++i) {
+		if (strcmp(preload->fonts[i], font) == 0) {
+			return true;
 		}
+	}
+	return false;
+}
 
-		size_t text_ln =
-			format_text(style.format, NULL, format_state_text, state);
-		char *text = malloc(text_ln + 1);
-		if (text == NULL) {
-			fprintf(stderr, "allocation failed");
-			return 0;
-		}
-		format_text(style.format, text, format_state_text, state);
+static void add_font(struct font_preload *preload,
+		const struct mako_style *style) {
+	if (style->spec.font && style->font != NULL &&
+			!has_font(preload, style->font)) {
+		preload->fonts[preload->font_count++] = style->font;
+	}
+}
 
-		int hidden_height = render_notification(
-				cairo, state, &style, text, total_height, scale);
-		free(text);
-		finish_style(&style);
+// Loads the fonts of every style, and renders common glyphs with each of them,
+// the way the first notification would be.
+static void preload_fonts(struct mako_state *state) {
+	struct mako_config *config = &state->config;
 
-		total_height += hidden_height;
+	struct font_preload preload = {0};
+	preload.fonts = calloc(wl_list_length(&config->criteria) + 1,
+		sizeof(char *));
+	if (preload.fonts == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return;
+	}
+	struct mako_criteria *criteria;
+	wl_list_for_each(criteria, &config->criteria, link) {
+		add_font(&preload, &criteria->style);
+	}
+	add_font(&preload, &config->hidden_style);
+
+	// Same size and font options as the first frame, which is rendered before
+	// the surface enters an output.
+	const struct mako_style *style = &global_criteria(config)->style;
+	preload.width = style->width > 0 ? style->width : 1;
+	preload.height = style->height > 0 ? style->height : 1;
+	preload.scale = 1;
+	preload.subpixel = -1;
+	if (state->surface_output != NULL) {
+		preload.scale = state->surface_output->scale;
+		preload.subpixel = state->surface_output->subpixel;
 	}
 
-	return total_height;
+	if (preload.font_count > 0 &&
+			parse_text_markup(preload_markup, &preload.text)) {
+		run_worker_pool_on_each(&state->layout_pool, preload_thread_fonts,
+			&preload);
+	}
+	finish_parsed_text(&preload.text);
+	free(preload.fonts);
+}
+
+static void handle_font_preload(void *data) {
+	struct mako_state *state = data;
+	state->font_preload = NULL;
+	preload_fonts(state);
+}
+
+// Preloads fonts once the event loop is idle, if enabled. Called again when
+// the config changes, in case it uses new fonts.
+void schedule_font_preload(struct mako_state *state) {
+	if (!state->config.preload_fonts || state->font_preload != NULL) {
+		return;
+	}
+	state->font_preload = add_event_loop_idle(&state->event_loop,
+		handle_font_preload, state);
 }
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "spsc-queue.h"
+
+// `capacity` is rounded up to a power of two, so that indices can wrap around
+// freely and be masked into the ring.
+bool init_spsc_queue(struct mako_spsc_queue *queue, size_t capacity) {
+	size_t size = 1;
+	while (size < capacity) {
+		size *= 2;
+	}
+
+	queue->items = calloc(size, sizeof(void *));
+	if (queue->items == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+	queue->capacity = size;
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+	return true;
+}
+
+void finish_spsc_queue(struct mako_spsc_queue *queue) {
+	free(queue->items);
+	queue->items = NULL;
+}
+
+// Producer side. Returns false if the queue is full.
+bool spsc_queue_push(struct mako_spsc_queue *queue, void *item) {
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if (tail - head == queue->capacity) {
+		return false;
+	}
+
+	queue->items[tail & (queue->capacity - 1)] = item;
+	// Publishes the item to the consumer
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+// Consumer side. Returns NULL if the queue is empty.
+void *spsc_queue_pop(struct mako_spsc_queue *queue) {
+	size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	if (head == tail) {
+		return NULL;
+	}
+
+	void *item = queue->items[head & (queue->capacity - 1)];
+	// Hands the slot back to the producer
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return item;
+}
+
+// Producer side.
+bool spsc_queue_full(struct mako_spsc_queue *queue) {
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	return tail - head == queue->capacity;
+}
@@ -0,0 +1,305 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_DISPATCH
+#endif
+#endif
+
+#include "text.h"
+
+// Longest replacement written by escape_markup_char.
+#define MAX_ESCAPE_LEN 6
+
+// Input is escaped in chunks of this size, so that the output buffer only
+// needs to grow by a bounded worst case at a time.
+#define ESCAPE_CHUNK_LEN 4096
+
+void init_text_buffer(struct mako_text_buffer *buf) {
+	memset(buf, 0, sizeof(struct mako_text_buffer));
+}
+
+void finish_text_buffer(struct mako_text_buffer *buf) {
+	free(buf->data);
+	init_text_buffer(buf);
+}
+
+void reset_text_buffer(struct mako_text_buffer *buf) {
+	buf->len = 0;
+	if (buf->data != NULL) {
+		buf->data[0] = '\0';
+	}
+}
+
+// Makes sure `len` more bytes (plus the NUL terminator) can be written after
+// the current contents.
+bool text_buffer_reserve(struct mako_text_buffer *buf, size_t len) {
+	size_t needed = buf->len + len + 1;
+	if (needed <= buf->size) {
+		return true;
+	}
+
+	size_t size = buf->size ? buf->size : 64;
+	while (size < needed) {
+		size *= 2;
+	}
+
+	char *data = realloc(buf->data, size);
+	if (data == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+	buf->data = data;
+	buf->size = size;
+	return true;
+}
+
+bool text_buffer_append(struct mako_text_buffer *buf, const char *s,
+		size_t len) {
+	if (!text_buffer_reserve(buf, len)) {
+		return false;
+	}
+	memcpy(buf->data + buf->len, s, len);
+	buf->len += len;
+	buf->data[buf->len] = '\0';
+	return true;
+}
+
+// Writes the escaped form of `c` to `dst` and returns its length.
+static size_t escape_markup_char(char c, char *dst) {
+	const char *replacement;
+	size_t len;
+	switch (c) {
+	case '&': replacement = "&amp;"; len = 5; break;
+	case '<': replacement = "&lt;"; len = 4; break;
+	case '>': replacement = "&gt;"; len = 4; break;
+	case '\'': replacement = "&apos;"; len = 6; break;
+	case '"': replacement = "&quot;"; len = 6; break;
+	default:
+		dst[0] = c;
+		return 1;
+	}
+	memcpy(dst, replacement, len);
+	return len;
+}
+
+static bool is_space(char c) {
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// The escape loops below all work the same way: copy `src` to `dst` until
+// `stop` is reached, `end` being the end of the whole input. Vectorized loops
+// may read up to `end` and overshoot `stop` by less than a block; they leave
+// what's left of the input to the next loop.
+typedef void (*escape_loop_func_t)(char **dst, const char **src,
+	const char *stop, const char *end);
+
+static void escape_loop_scalar(char **dst, const char **src,
+		const char *stop, const char *end) {
+	char *d = *dst;
+	const char *s = *src;
+	for (; s < stop; ++s) {
+		d += escape_markup_char(*s, d);
+	}
+	*dst = d;
+	*src = s;
+}
+
+#ifdef __SSE2__
+static inline int special_mask_sse2(__m128i v) {
+	__m128i special = _mm_or_si128(
+		_mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('&')),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('<'))),
+		_mm_or_si128(
+			_mm_or_si128(
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('>')),
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('\''))),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))));
+	return _mm_movemask_epi8(special);
+}
+
+// Whitespace is ' ' or a byte between '\t' and '\r'. Subtracting '\t' moves
+// the latter to 0-4, so an unsigned minimum with 4 finds them.
+static inline int space_mask_sse2(__m128i v) {
+	__m128i shifted = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+	__m128i control = _mm_cmpeq_epi8(
+		_mm_min_epu8(shifted, _mm_set1_epi8(4)), shifted);
+	__m128i space = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+	return _mm_movemask_epi8(_mm_or_si128(control, space));
+}
+
+// Stores whole blocks without looking at them, then only advances past the
+// bytes that didn't need escaping. The output buffer always has room for a
+// full block.
+static void escape_loop_sse2(char **dst, const char **src,
+		const char *stop, const char *end) {
+	char *d = *dst;
+	const char *s = *src;
+	while (s < stop && end - s >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		_mm_storeu_si128((__m128i *)d, v);
+		int mask = special_mask_sse2(v);
+		if (mask == 0) {
+			d += 16;
+			s += 16;
+			continue;
+		}
+		int clean = __builtin_ctz(mask);
+		d += clean;
+		s += clean;
+		d += escape_markup_char(*s, d);
+		++s;
+	}
+	*dst = d;
+	*src = s;
+}
+#endif
+
+#ifdef HAVE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static void escape_loop_avx2(char **dst, const char **src,
+		const char *stop, const char *end) {
+	char *d = *dst;
+	const char *s = *src;
+	while (s < stop && end - s >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)s);
+		_mm256_storeu_si256((__m256i *)d, v);
+		__m256i special = _mm256_or_si256(
+			_mm256_or_si256(
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')),
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('<'))),
+			_mm256_or_si256(
+				_mm256_or_si256(
+					_mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')),
+					_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\''))),
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(special);
+		if (mask == 0) {
+			d += 32;
+			s += 32;
+			continue;
+		}
+		int clean = __builtin_ctz(mask);
+		d += clean;
+		s += clean;
+		d += escape_markup_char(*s, d);
+		++s;
+	}
+	*dst = d;
+	*src = s;
+}
+#endif
+
+// libgcc detects the CPU features on startup, so checking them is cheap.
+static escape_loop_func_t get_escape_loop(void) {
+#if defined(HAVE_AVX2_DISPATCH)
+	if (__builtin_cpu_supports("avx2")) {
+		return escape_loop_avx2;
+	}
+	return escape_loop_sse2;
+#elif defined(__SSE2__)
+	return escape_loop_sse2;
+#else
+	return escape_loop_scalar;
+#endif
+}
+
+// Appends the `len` first bytes of `s` to `buf`, replacing the characters that
+// have a special meaning in Pango markup with entities. The output length is
+// found while copying, in a single pass over the input.
+bool text_buffer_append_escaped(struct mako_text_buffer *buf, const char *s,
+		size_t len) {
+	escape_loop_func_t escape_loop = get_escape_loop();
+	const char *end = s + len;
+
+	while (s < end) {
+		size_t chunk_len = end - s;
+		if (chunk_len > ESCAPE_CHUNK_LEN) {
+			chunk_len = ESCAPE_CHUNK_LEN;
+		}
+		// Vectorized loops may overshoot the chunk by one block, with up to
+		// one escaped character in it.
+		if (!text_buffer_reserve(buf,
+				chunk_len * MAX_ESCAPE_LEN + 32 + MAX_ESCAPE_LEN)) {
+			return false;
+		}
+
+		char *d = buf->data + buf->len;
+		const char *stop = s + chunk_len;
+		escape_loop(&d, &s, stop, end);
+		if (s < stop) {
+			escape_loop_scalar(&d, &s, stop, end);
+		}
+		buf->len = d - buf->data;
+	}
+
+	if (buf->data != NULL) {
+		buf->data[buf->len] = '\0';
+	}
+	return true;
+}
+
+static size_t count_leading_space(const char *s, size_t len) {
+	size_t i = 0;
+#ifdef __SSE2__
+	for (; len - i >= 16; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		int mask = space_mask_sse2(v);
+		if (mask != 0xFFFF) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+#endif
+	while (i < len && is_space(s[i])) {
+		++i;
+	}
+	return i;
+}
+
+static size_t count_trailing_space(const char *s, size_t len) {
+	size_t i = 0;
+#ifdef __SSE2__
+	for (; len - i >= 16; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + len - i - 16));
+		int mask = space_mask_sse2(v);
+		if (mask != 0xFFFF) {
+			// The last non-space byte of the block is its highest clear bit.
+			unsigned int nonspace = ~mask & 0xFFFF;
+			int last = 31 - __builtin_clz(nonspace);
+			return i + 15 - last;
+		}
+	}
+#endif
+	while (i < len && is_space(s[len - i - 1])) {
+		++i;
+	}
+	return i;
+}
+
+// Removes leading and trailing whitespace.
+void text_buffer_trim(struct mako_text_buffer *buf) {
+	if (buf->len == 0) {
+		return;
+	}
+
+	size_t leading = count_leading_space(buf->data, buf->len);
+	size_t trailing = 0;
+	if (leading < buf->len) {
+		trailing = count_trailing_space(buf->data + leading,
+			buf->len - leading);
+	}
+
+	size_t trimmed_len = buf->len - leading - trailing;
+	if (leading > 0) {
+		memmove(buf->data, buf->data + leading, trimmed_len);
+	}
+	buf->len = trimmed_len;
+	buf->data[buf->len] = '\0';
+}
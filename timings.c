@@ -0,0 +1,61 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <time.h>
+
+#include "timings.h"
+
+#define MAX_TIMINGS 16
+
+struct timing {
+	const char *step;
+	struct timespec time;
+};
+
+// Only touched by the main thread, and by threads it starts after
+// end_timings.
+static struct {
+	bool recording;
+	struct timespec start;
+	struct timing steps[MAX_TIMINGS];
+	size_t step_count;
+} timings;
+
+static double get_elapsed_ms(const struct timespec *from,
+		const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1000.0 +
+		(to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+void start_timings(void) {
+	clock_gettime(CLOCK_MONOTONIC, &timings.start);
+	timings.step_count = 0;
+	timings.recording = true;
+}
+
+void mark_timing(const char *step) {
+	if (!timings.recording || timings.step_count == MAX_TIMINGS) {
+		return;
+	}
+	struct timing *timing = &timings.steps[timings.step_count++];
+	timing->step = step;
+	clock_gettime(CLOCK_MONOTONIC, &timing->time);
+}
+
+void end_timings(bool print) {
+	if (!timings.recording) {
+		return;
+	}
+	timings.recording = false;
+	if (!print) {
+		return;
+	}
+
+	const struct timespec *last = &timings.start;
+	for (size_t i = 0; i < timings.step_count; ++i) {
+		const struct timing *timing = &timings.steps[i];
+		fprintf(stderr, "%-24s %8.3f ms (+%.3f ms)\n", timing->step,
+			get_elapsed_ms(&timings.start, &timing->time),
+			get_elapsed_ms(last, &timing->time));
+		last = &timing->time;
+	}
+}
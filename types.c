@@ -14,7 +14,7 @@
 #include "types.h"
 
 
-const char VALID_FORMAT_SPECIFIERS[] = "%asbht";
+const char VALID_FORMAT_SPECIFIERS[] = "%asbcght";
 
 
 bool parse_boolean(const char *string, bool *out) {
@@ -203,3 +203,85 @@ bool parse_format(const char *string, char **out) {
 	*out = strdup(token);
 	return true;
 }
+
+// Compile a format string, as returned by parse_format, into a list of
+// operations. On success, any previous contents of `out` are released.
+bool compile_format(const char *format, struct mako_format_program *out) {
+	// There can't be more operations than characters in the format.
+	size_t format_len = strlen(format);
+	struct mako_format_program program = {0};
+	program.literals = strdup(format);
+	program.ops = calloc(format_len + 1, sizeof(struct mako_format_op));
+	if (program.literals == NULL || program.ops == NULL) {
+		finish_format_program(&program);
+		return false;
+	}
+
+	size_t last = 0;
+	for (size_t i = 0; i < format_len; ++i) {
+		if (format[i] != '%' || format[i + 1] == '\0') {
+			continue;
+		}
+
+		if (i > last) {
+			program.ops[program.op_count++] = (struct mako_format_op){
+				.type = MAKO_FORMAT_OP_LITERAL,
+				.offset = last,
+				.len = i - last,
+			};
+		}
+
+		if (format[i + 1] == '%') {
+			program.ops[program.op_count++] = (struct mako_format_op){
+				.type = MAKO_FORMAT_OP_LITERAL,
+				.offset = i,
+				.len = 1,
+			};
+		} else {
+			program.ops[program.op_count++] = (struct mako_format_op){
+				.type = MAKO_FORMAT_OP_SPECIFIER,
+				.specifier = format[i + 1],
+			};
+		}
+
+		++i; // Skip the specifier character
+		last = i + 1;
+	}
+
+	if (format_len > last) {
+		program.ops[program.op_count++] = (struct mako_format_op){
+			.type = MAKO_FORMAT_OP_LITERAL,
+			.offset = last,
+			.len = format_len - last,
+		};
+	}
+
+	finish_format_program(out);
+	*out = program;
+	return true;
+}
+
+bool copy_format_program(struct mako_format_program *dst,
+		const struct mako_format_program *src) {
+	struct mako_format_program program = {0};
+	program.op_count = src->op_count;
+	if (src->literals != NULL) {
+		program.literals = strdup(src->literals);
+		program.ops = calloc(src->op_count + 1, sizeof(struct mako_format_op));
+		if (program.literals == NULL || program.ops == NULL) {
+			finish_format_program(&program);
+			return false;
+		}
+		memcpy(program.ops, src->ops,
+			src->op_count * sizeof(struct mako_format_op));
+	}
+
+	*dst = program;
+	return true;
+}
+
+void finish_format_program(struct mako_format_program *program) {
+	free(program->literals);
+	free(program->ops);
+	memset(program, 0, sizeof(struct mako_format_program));
+}
@@ -8,6 +8,7 @@
 #include "mako.h"
 #include "notification.h"
 #include "render.h"
+#include "timings.h"
 #include "wayland.h"
 
 static void noop() {
@@ -284,10 +285,12 @@ bool init_wayland(struct mako_state *state) {
 		fprintf(stderr, "failed to create display\n");
 		return false;
 	}
+	mark_timing("display connection");
 
 	state->registry = wl_display_get_registry(state->display);
 	wl_registry_add_listener(state->registry, &registry_listener, state);
 	wl_display_roundtrip(state->display);
+	mark_timing("registry roundtrip");
 
 	if (state->compositor == NULL) {
 		fprintf(stderr, "compositor doesn't support wl_compositor\n");
@@ -308,6 +311,7 @@ bool init_wayland(struct mako_state *state) {
 			get_xdg_output(output);
 		}
 		wl_display_roundtrip(state->display);
+		mark_timing("output roundtrip");
 	}
 	if (state->xdg_output_manager == NULL &&
 			strcmp(state->config.output, "") != 0) {
@@ -379,6 +383,12 @@ static struct mako_output *get_configured_output(struct mako_state *state) {
 }
 
 void send_frame(struct mako_state *state) {
+	// A frame sent right away makes any scheduled one redundant.
+	if (state->frame_timer != NULL) {
+		destroy_timer(state->frame_timer);
+		state->frame_timer = NULL;
+	}
+
 	int scale = 1;
 	if (state->surface_output != NULL) {
 		scale = state->surface_output->scale;
@@ -489,3 +499,23 @@ void send_frame(struct mako_state *state) {
 	wl_surface_commit(state->surface);
 	state->current_buffer->busy = true;
 }
+
+static void handle_frame_timer(void *data) {
+	struct mako_state *state = data;
+	state->frame_timer = NULL;
+	send_frame(state);
+}
+
+// Render on the next iteration of the event loop, once the events that are
+// already pending have been handled. This lets D-Bus replies go out before
+// rendering, and coalesces the frames of a burst of changes into one.
+void schedule_frame(struct mako_state *state) {
+	if (state->frame_timer != NULL) {
+		return;
+	}
+	state->frame_timer = add_event_loop_timer(&state->event_loop, 0,
+		handle_frame_timer, state);
+	if (state->frame_timer == NULL) {
+		send_frame(state);
+	}
+}
@@ -0,0 +1,171 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "worker-pool.h"
+
+static void *run_worker(void *data) {
+	struct mako_worker_pool *pool = data;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		while (!pool->stopping && pool->next_item >= pool->item_count) {
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+		}
+		if (pool->stopping) {
+			break;
+		}
+
+		mako_work_func_t func = pool->func;
+		void *item = pool->items[pool->next_item++];
+		pthread_mutex_unlock(&pool->mutex);
+
+		func(item);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (++pool->done_count == pool->item_count) {
+			pthread_cond_signal(&pool->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+// Starts up to `thread_count` threads. If some can't be started, the pool
+// makes do with fewer, down to none, in which case batches are run by the
+// submitting thread alone.
+bool init_worker_pool(struct mako_worker_pool *pool, size_t thread_count) {
+	memset(pool, 0, sizeof(struct mako_worker_pool));
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	if (thread_count == 0) {
+		return true;
+	}
+
+	pool->threads = calloc(thread_count, sizeof(pthread_t));
+	if (pool->threads == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+
+	for (size_t i = 0; i < thread_count; ++i) {
+		int ret = pthread_create(&pool->threads[i], NULL, run_worker, pool);
+		if (ret != 0) {
+			fprintf(stderr, "failed to start worker thread: %s\n",
+				strerror(ret));
+			break;
+		}
+		++pool->thread_count;
+	}
+	return true;
+}
+
+void finish_worker_pool(struct mako_worker_pool *pool) {
+	pthread_mutex_lock(&pool->mutex);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (size_t i = 0; i < pool->thread_count; ++i) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	free(pool->threads);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+// Calls `func` on each of the `count` items, spread over the pool's threads,
+// and returns once all of them are done.
+void run_worker_pool(struct mako_worker_pool *pool, mako_work_func_t func,
+		void **items, size_t count) {
+	if (pool->thread_count == 0 || count <= 1) {
+		for (size_t i = 0; i < count; ++i) {
+			func(items[i]);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->func = func;
+	pool->items = items;
+	pool->item_count = count;
+	pool->next_item = 0;
+	pool->done_count = 0;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	while (pool->next_item < pool->item_count) {
+		void *item = pool->items[pool->next_item++];
+		pthread_mutex_unlock(&pool->mutex);
+
+		func(item);
+
+		pthread_mutex_lock(&pool->mutex);
+		++pool->done_count;
+	}
+
+	while (pool->done_count < pool->item_count) {
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	}
+
+	pool->func = NULL;
+	pool->items = NULL;
+	pool->item_count = pool->next_item = pool->done_count = 0;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+struct each_thread_item {
+	mako_work_func_t func;
+	void *data;
+	pthread_barrier_t *barrier;
+};
+
+static void run_each_thread_item(void *data) {
+	struct each_thread_item *item = data;
+	item->func(item->data);
+	// Holding on to the thread until all items are taken makes sure no thread
+	// takes two of them.
+	pthread_barrier_wait(item->barrier);
+}
+
+// Calls `func` once on each thread of the pool, including the calling thread,
+// for per-thread state, and returns once all of them are done.
+void run_worker_pool_on_each(struct mako_worker_pool *pool,
+		mako_work_func_t func, void *data) {
+	size_t count = pool->thread_count + 1;
+	struct each_thread_item *items = NULL;
+	void **item_ptrs = NULL;
+	pthread_barrier_t barrier;
+	if (count == 1 || pthread_barrier_init(&barrier, NULL, count) != 0) {
+		func(data);
+		return;
+	}
+
+	items = calloc(count, sizeof(struct each_thread_item));
+	item_ptrs = calloc(count, sizeof(void *));
+	if (items == NULL || item_ptrs == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		func(data);
+		goto out;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		items[i] = (struct each_thread_item){
+			.func = func,
+			.data = data,
+			.barrier = &barrier,
+		};
+		item_ptrs[i] = &items[i];
+	}
+	run_worker_pool(pool, run_each_thread_item, item_ptrs, count);
+
+out:
+	free(item_ptrs);
+	free(items);
+	pthread_barrier_destroy(&barrier);
+}